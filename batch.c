@@ -0,0 +1,837 @@
+/*============================================================================
+  batch.c
+
+  Conversion of values read from the command line or from a stream, and
+  printing of the results.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "batch.h"
+
+// Where the lines to convert come from: the mapped contents of a regular
+//  file if possible, otherwise whatever can be read from the stream
+typedef struct _BatchInput
+  {
+  FILE *file;
+  void *map_base;       // As returned by mmap(), or NULL
+  size_t map_size;
+  const char *map;      // The unread part of the file
+  size_t map_length;
+  char *carry;          // A partial line read from the stream
+  size_t carry_length;
+  BOOL eof;
+  } BatchInput;
+
+// One piece of the input, and the results of converting it. The lines
+//  are not modified, so they can be read in place from a mapped file.
+typedef struct _BatchChunk
+  {
+  const char *data;     // Whole lines, in buffer or in the mapped file
+  size_t length;
+  char *buffer;         // Storage for lines read from a stream
+  size_t capacity;
+  size_t head_length;   // Leading bytes the writer must convert itself
+  char *out;            // Output and error messages, in memory
+  size_t out_length;
+  char *err;
+  size_t err_length;
+  Converter converter;  // State after the last line of the chunk
+  BatchStats stats;     // Of the lines converted by the worker
+  BatchAggregate aggregate; // Of the results, if they are being gathered
+  int status;
+  BOOL converted;
+  } BatchChunk;
+
+// The chunks in flight, and the workers converting them. Chunks are used
+//  in rotation: chunk number n lives in chunks[n % n_chunks].
+typedef struct _BatchPool
+  {
+  const BatchOptions *options;
+  const char *to;
+  BatchInput *input;
+  BatchChunk *chunks;
+  int n_chunks;
+  long n_read;          // Chunks read so far
+  long next_job;        // Next chunk for a worker to take
+  BOOL finished;        // No more input
+  pthread_mutex_t lock;
+  pthread_cond_t job_ready;
+  pthread_cond_t chunk_done;
+  } BatchPool;
+
+
+/*============================================================================
+  batch_now
+  A monotonic time in seconds, for statistics.
+============================================================================*/
+static double batch_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+
+/*============================================================================
+  batch_converter_init
+  Initialize a converter for the given options, which record its
+  statistics, if they are wanted.
+============================================================================*/
+void batch_converter_init (Converter *converter, const BatchOptions *options)
+  {
+  converter_init (converter, options->default_to_iec);
+  converter->autocorrect = options->autocorrect;
+  if (options->stats) converter->stats = &options->stats->converter;
+  }
+
+
+/*============================================================================
+  batch_stats_add
+  Add the counts and times in other to those in self.
+============================================================================*/
+void batch_stats_add (BatchStats *self, const BatchStats *other)
+  {
+  self->lines += other->lines;
+  self->format_time += other->format_time;
+  converter_stats_add (&self->converter, &other->converter);
+  }
+
+
+/*============================================================================
+  batch_aggregate_init
+  Start gathering the given figures, which are BatchFigures or'd 
+  together, in the given units.
+============================================================================*/
+void batch_aggregate_init (BatchAggregate *self, int figures, 
+    const Units *units)
+  {
+  memset (self, 0, sizeof (*self));
+  self->figures = figures;
+  self->units = *units;
+  self->min = INFINITY;
+  self->max = -INFINITY;
+  }
+
+
+/*============================================================================
+  batch_aggregate_sum
+  Add a value to a compensated sum, keeping the part of it that does
+  not fit in the sum in the compensation (Neumaier's variant of Kahan
+  summation, which holds good when the value is larger than the sum).
+============================================================================*/
+static void batch_aggregate_sum (BatchAggregate *self, double value)
+  {
+  double t = self->sum + value;
+  if (!isfinite (t))
+    {
+    // The compensation can't help, and inf - inf would make it NaN
+    self->sum = t;
+    return;
+    }
+  if (fabs (self->sum) >= fabs (value))
+    self->compensation += (self->sum - t) + value;
+  else
+    self->compensation += (value - t) + self->sum;
+  self->sum = t;
+  }
+
+
+/*============================================================================
+  batch_units_equal
+============================================================================*/
+static BOOL batch_units_equal (const Units *a, const Units *b)
+  {
+  if (a->n_elements != b->n_elements) return FALSE;
+  for (int i = 0; i < a->n_elements; i++)
+    {
+    if (a->units[i].unit != b->units[i].unit || 
+        a->units[i].power != b->units[i].power ||
+        a->units[i].prefix_power != b->units[i].prefix_power)
+      return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  batch_aggregate_plan
+  Get the plan that converts results in the given units to those of the
+  figures, or NULL if they are the same. Every result is converted to 
+  the same units, but these can differ: "GB" is read as gibibytes or as
+  gigabytes, depending on the units converted from. The plan for the 
+  last units that differed is kept, for the results that follow.
+============================================================================*/
+static const UnitsPlan *batch_aggregate_plan (BatchAggregate *self, 
+    const Units *units)
+  {
+  char *error = NULL;
+  if (batch_units_equal (units, &self->units)) return NULL;
+  if (self->other.n_elements > 0 && batch_units_equal (units, &self->other))
+    return &self->plan;
+  if (!units_plan_init (&self->plan, units, &self->units, &error))
+    {
+    // Can't happen, as the units were converted to from the same text
+    free (error);
+    return NULL;
+    }
+  self->other = *units;
+  return &self->plan;
+  }
+
+
+/*============================================================================
+  batch_aggregate_value
+  Gather one result, in the given units.
+============================================================================*/
+void batch_aggregate_value (BatchAggregate *self, const Units *units,
+    double value)
+  {
+  const UnitsPlan *plan = batch_aggregate_plan (self, units);
+  if (plan) value = units_plan_apply (plan, value);
+  self->count++;
+  batch_aggregate_sum (self, value);
+  if (value < self->min) self->min = value;
+  if (value > self->max) self->max = value;
+  }
+
+
+/*============================================================================
+  batch_aggregate_add
+  Add the results gathered in other to those in self, as if they had
+  been gathered there, after those already in self. Both are in the 
+  same units.
+============================================================================*/
+void batch_aggregate_add (BatchAggregate *self, const BatchAggregate *other)
+  {
+  self->count += other->count;
+  batch_aggregate_sum (self, other->sum);
+  self->compensation += other->compensation;
+  if (other->min < self->min) self->min = other->min;
+  if (other->max > self->max) self->max = other->max;
+  }
+
+
+/*============================================================================
+  batch_aggregate_print
+  Print the figures gathered, one to a line, in the units of the results 
+  or, with humanize, in the multiple of them that suits each figure. 
+  Returns 1, with a message to err, if figures other than the count are 
+  wanted but there were no results to take them from; otherwise 0.
+============================================================================*/
+int batch_aggregate_print (const BatchAggregate *self, 
+    const BatchOptions *options, FILE *out, FILE *err)
+  {
+  static const struct { BatchFigure figure; const char *name; } names[] =
+    {
+    { batch_count, "count" },
+    { batch_sum, "sum" },
+    { batch_min, "min" },
+    { batch_max, "max" },
+    { batch_mean, "mean" },
+    };
+  double sum = isfinite (self->sum) ? self->sum + self->compensation 
+    : self->sum;
+  size_t i;
+
+  if (self->figures & batch_count)
+    fprintf (out, "count = %lu\n", self->count);
+  if (self->count == 0 && (self->figures & ~batch_count))
+    {
+    fprintf (err, "No values were converted\n");
+    return 1;
+    }
+
+  for (i = 1; i < sizeof (names) / sizeof (names[0]); i++)
+    {
+    char s[MAX_FORMATTED_UNITS + MAX_NUMBER_STRING];
+    Units units = self->units;
+    double value;
+    if (!(self->figures & names[i].figure)) continue;
+    switch (names[i].figure)
+      {
+      case batch_min: value = self->min; break;
+      case batch_max: value = self->max; break;
+      case batch_mean: value = sum / self->count; break;
+      default: value = sum; break;
+      }
+    if (options->humanize)
+      value = units_humanize (&units, value, options->default_to_iec);
+    units_format_value (s, sizeof (s), &units, value, 
+      options->force_decimal, options->number_format);
+    fprintf (out, "%s = %s\n", names[i].name, s);
+    }
+
+  return 0;
+  }
+
+
+/*============================================================================
+  batch_print
+  Print a value and its conversion, in the units of the converter's last
+  conversion, or with humanize, in the multiple of them that suits the
+  result. If the results are being gathered, the result is only added
+  to the others.
+============================================================================*/
+void batch_print (const Converter *converter, double value,
+    double res, const BatchOptions *options, FILE *out)
+  {
+  if (options->aggregate)
+    {
+    batch_aggregate_value (options->aggregate, &converter->tu, res);
+    return;
+    }
+
+  char fs[MAX_FORMATTED_UNITS + MAX_NUMBER_STRING];
+  char ts[MAX_FORMATTED_UNITS + MAX_NUMBER_STRING];
+  double start = options->stats ? batch_now () : 0;
+  Units tu = converter->tu;
+  if (options->humanize)
+    res = units_humanize (&tu, res, options->default_to_iec);
+  units_format_value (fs, sizeof (fs), &converter->fu, value,
+    options->force_decimal, options->number_format);
+  units_format_value (ts, sizeof (ts), &tu, res,
+    options->force_decimal, options->number_format);
+  fputs (fs, out);
+  fputs (" = ", out);
+  fputs (ts, out);
+  putc ('\n', out);
+  if (options->stats) options->stats->format_time += batch_now () - start;
+  }
+
+
+/*============================================================================
+  batch_report
+  Print the result of a conversion to out, or the error message to err.
+  If the units had to be corrected, that is reported to err as well.
+  Returns 0 on success and 1 on failure.
+============================================================================*/
+static int batch_report (ConverterStatus status, Converter *converter,
+    double value, double res, char *error, const BatchOptions *options, 
+    FILE *out, FILE *err)
+  {
+  switch (status)
+    {
+    case converter_ok:
+      if (converter->correction)
+        {
+        fprintf (err, "Warning: %s\n", converter->correction);
+        free (converter->correction);
+        converter->correction = NULL;
+        }
+      break;
+    case converter_bad_units:
+    case converter_incompatible_units:
+      fprintf (err, "Error: %s\n", error);
+      free (error);
+      return 1;
+    default:
+      fprintf (err, "%s\n", error);
+      free (error);
+      return 1;
+    }
+
+  batch_print (converter, value, res, options, out);
+  return 0;
+  }
+
+
+/*============================================================================
+  batch_convert
+  Convert one value and print the result to out, or an error message to
+  err. The arguments are as for converter_convert. Returns 0 on success
+  and 1 on failure.
+============================================================================*/
+int batch_convert (Converter *converter, const char *from,
+    const char *from_units_suffix, const char *to,
+    const BatchOptions *options, FILE *out, FILE *err)
+  {
+  double value, res;
+  char *error = NULL;
+  if (options->stats) options->stats->lines++;
+  ConverterStatus status = converter_convert (converter, from, 
+    from_units_suffix, to, &value, &res, &error);
+  return batch_report (status, converter, value, res, error, options, 
+    out, err);
+  }
+
+
+/*============================================================================
+  batch_trim
+  Skip leading and trailing white space in a line of the given length.
+  Returns the length of what is left.
+============================================================================*/
+static size_t batch_trim (const char **line, size_t length)
+  {
+  const char *s = *line;
+  while (length > 0 && isspace ((int)s[length - 1])) length--;
+  while (length > 0 && isspace ((int)*s)) 
+    {
+    s++;
+    length--;
+    }
+  *line = s;
+  return length;
+  }
+
+
+/*============================================================================
+  batch_convert_line
+  Convert one line of input, of the given length, which is not modified.
+  A line holds a value and its units, either concatenated or separated by 
+  whitespace, or just a value, which takes the units of the previous line. 
+  Blank lines are ignored.
+============================================================================*/
+int batch_convert_line (Converter *converter, const char *line, 
+    size_t length, const char *to, const BatchOptions *options, FILE *out, 
+    FILE *err)
+  {
+  double value, res;
+  char *error = NULL;
+
+  if (options->stats) options->stats->lines++;
+  length = batch_trim (&line, length);
+  if (length == 0) return 0;
+  ConverterStatus status = converter_convert_text (converter, line, length,
+    to, &value, &res, &error);
+  return batch_report (status, converter, value, res, error, options, 
+    out, err);
+  }
+
+
+/*============================================================================
+  batch_convert_lines
+  Convert each newline-terminated line of the given text. The last line 
+  need not have a newline.
+============================================================================*/
+static int batch_convert_lines (Converter *converter, const char *text,
+    size_t length, const char *to, const BatchOptions *options, FILE *out,
+    FILE *err)
+  {
+  const char *p = text, *end = text + length;
+  int status = 0;
+
+  while (p < end)
+    {
+    const char *eol = memchr (p, '\n', end - p);
+    if (!eol) eol = end;
+    status |= batch_convert_line (converter, p, eol - p, to, options, 
+      out, err);
+    p = eol + 1;
+    }
+
+  return status;
+  }
+
+
+/*============================================================================
+  batch_convert_stream
+  Convert each line read from "in". Only one line is held in memory at a 
+  time, so the input can be of any length.
+============================================================================*/
+static int batch_convert_stream (FILE *in, const char *to,
+    const BatchOptions *options)
+  {
+  Converter converter;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  int status = 0;
+
+  batch_converter_init (&converter, options);
+
+  while ((length = getline (&line, &size, in)) >= 0)
+    status |= batch_convert_line (&converter, line, length, to, options,
+      stdout, stderr);
+
+  free (line);
+  converter_destroy (&converter);
+  return status;
+  }
+
+
+/*============================================================================
+  batch_map_input
+  Map the rest of the input into memory, if it is a regular file. Returns
+  FALSE if it can't be mapped, and must be read instead.
+============================================================================*/
+static BOOL batch_map_input (BatchInput *input)
+  {
+  int fd = fileno (input->file);
+  off_t offset = lseek (fd, 0, SEEK_CUR);
+  struct stat sb;
+
+  if (offset < 0 || fstat (fd, &sb) != 0 || !S_ISREG (sb.st_mode) ||
+      sb.st_size <= offset || (uintmax_t)sb.st_size > SIZE_MAX)
+    return FALSE;
+
+  void *map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return FALSE;
+  madvise (map, sb.st_size, MADV_SEQUENTIAL);
+
+  input->map_base = map;
+  input->map_size = sb.st_size;
+  input->map = (const char *)map + offset;
+  input->map_length = sb.st_size - offset;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  batch_read_chunk
+  Fill a chunk with whole lines read from the input stream. The partial 
+  line at the end of the previous chunk is held in input->carry, and is 
+  replaced with the partial line at the end of this one. 
+============================================================================*/
+static void batch_read_chunk (BatchInput *input, BatchChunk *chunk)
+  {
+  size_t needed = input->carry_length + BATCH_CHUNK_SIZE;
+  if (chunk->capacity < needed)
+    {
+    free (chunk->buffer);
+    chunk->buffer = malloc (needed);
+    chunk->capacity = needed;
+    }
+
+  memcpy (chunk->buffer, input->carry, input->carry_length);
+  chunk->length = input->carry_length;
+  input->carry_length = 0;
+
+  while (!input->eof)
+    {
+    size_t n = fread (chunk->buffer + chunk->length, 1,
+      chunk->capacity - chunk->length, input->file);
+    if (n == 0)
+      {
+      input->eof = TRUE;
+      break;
+      }
+    chunk->length += n;
+
+    char *p = chunk->buffer + chunk->length;
+    while (p > chunk->buffer && p[-1] != '\n') p--;
+    if (p > chunk->buffer)
+      {
+      // Keep the partial line that follows the last newline for the
+      //  next chunk
+      input->carry_length = chunk->buffer + chunk->length - p;
+      input->carry = realloc (input->carry, input->carry_length + 1);
+      memcpy (input->carry, p, input->carry_length);
+      chunk->length = p - chunk->buffer;
+      break;
+      }
+
+    // No newline at all: a line longer than the chunk
+    if (chunk->length == chunk->capacity)
+      {
+      chunk->capacity *= 2;
+      chunk->buffer = realloc (chunk->buffer, chunk->capacity);
+      }
+    }
+
+  chunk->data = chunk->buffer;
+  }
+
+
+/*============================================================================
+  batch_next_chunk
+  Fill a chunk with the next whole lines of the input. A chunk from a 
+  mapped file is just a part of the mapping, so nothing is copied. 
+  Returns FALSE if there is no more input.
+============================================================================*/
+static BOOL batch_next_chunk (BatchInput *input, BatchChunk *chunk)
+  {
+  if (!input->map)
+    {
+    batch_read_chunk (input, chunk);
+    return chunk->length > 0;
+    }
+
+  if (input->map_length == 0) return FALSE;
+
+  size_t length = input->map_length;
+  if (length > BATCH_CHUNK_SIZE)
+    {
+    const char *eol = memchr (input->map + BATCH_CHUNK_SIZE, '\n', 
+      length - BATCH_CHUNK_SIZE);
+    if (eol) length = eol + 1 - input->map;
+    }
+
+  chunk->data = input->map;
+  chunk->length = length;
+  input->map += length;
+  input->map_length -= length;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  batch_convert_chunk
+  Convert the lines of a chunk, writing the results to memory. A value
+  without units takes the units of the line before, which might be in an
+  earlier chunk that is still being converted. So the lines up to the
+  first successful conversion -- the only ones that can depend on earlier
+  chunks -- are left for the writer, which converts them in order. From
+  then on, the chunk carries its own units. Statistics, and results that
+  are being gathered, are recorded in the chunk, for the writer to add to
+  the rest.
+============================================================================*/
+static void batch_convert_chunk (BatchChunk *chunk, const char *to,
+    const BatchOptions *shared_options)
+  {
+  const char *p = chunk->data, *end = chunk->data + chunk->length;
+  BatchOptions chunk_options = *shared_options, *options = &chunk_options;
+
+  memset (&chunk->stats, 0, sizeof (chunk->stats));
+  if (shared_options->stats) options->stats = &chunk->stats;
+  if (shared_options->aggregate)
+    {
+    batch_aggregate_init (&chunk->aggregate, 
+      shared_options->aggregate->figures, &shared_options->aggregate->units);
+    options->aggregate = &chunk->aggregate;
+    }
+  batch_converter_init (&chunk->converter, options);
+  chunk->status = 0;
+  chunk->head_length = chunk->length;
+  FILE *out = open_memstream (&chunk->out, &chunk->out_length);
+  FILE *err = open_memstream (&chunk->err, &chunk->err_length);
+
+  while (p < end)
+    {
+    const char *eol = memchr (p, '\n', end - p);
+    if (!eol) eol = end;
+
+    const char *from = p;
+    size_t length = batch_trim (&from, eol - p);
+    double value, res;
+    char *error = NULL;
+    ConverterStats before = chunk->stats.converter;
+    if (length > 0 && converter_convert_text (&chunk->converter, from, 
+        length, to, &value, &res, &error) == converter_ok)
+      {
+      chunk->head_length = p - chunk->data;
+      chunk->stats.lines++;
+      batch_print (&chunk->converter, value, res, options, out);
+      if (eol < end)
+        chunk->status = batch_convert_lines (&chunk->converter, eol + 1, 
+          end - eol - 1, to, options, out, err);
+      break;
+      }
+    // The writer converts this line again, and counts it then
+    chunk->stats.converter = before;
+    free (error);
+    p = eol + 1;
+    }
+
+  fclose (out);
+  fclose (err);
+  }
+
+
+/*============================================================================
+  batch_write_chunk
+  Convert the head of a chunk with the writer's converter, which holds
+  the state left by the chunks before, and write out the results. The
+  writer then takes on the chunk's state, if it has any.
+============================================================================*/
+static int batch_write_chunk (BatchChunk *chunk, Converter *converter,
+    const char *to, const BatchOptions *options)
+  {
+  int status = chunk->status;
+
+  status |= batch_convert_lines (converter, chunk->data, chunk->head_length,
+    to, options, stdout, stderr);
+
+  fwrite (chunk->out, 1, chunk->out_length, stdout);
+  fwrite (chunk->err, 1, chunk->err_length, stderr);
+  free (chunk->out);
+  free (chunk->err);
+  chunk->out = chunk->err = NULL;
+  if (options->stats) batch_stats_add (options->stats, &chunk->stats);
+  if (options->aggregate)
+    batch_aggregate_add (options->aggregate, &chunk->aggregate);
+
+  if (chunk->converter.planned)
+    converter_move (converter, &chunk->converter);
+  else
+    converter_destroy (&chunk->converter);
+  return status;
+  }
+
+
+/*============================================================================
+  batch_worker
+============================================================================*/
+static void *batch_worker (void *arg)
+  {
+  BatchPool *pool = arg;
+
+  pthread_mutex_lock (&pool->lock);
+  for (;;)
+    {
+    while (pool->next_job == pool->n_read && !pool->finished)
+      pthread_cond_wait (&pool->job_ready, &pool->lock);
+    if (pool->next_job == pool->n_read) break;
+
+    BatchChunk *chunk = &pool->chunks[pool->next_job++ % pool->n_chunks];
+    pthread_mutex_unlock (&pool->lock);
+    batch_convert_chunk (chunk, pool->to, pool->options);
+    pthread_mutex_lock (&pool->lock);
+    chunk->converted = TRUE;
+    pthread_cond_broadcast (&pool->chunk_done);
+    }
+  pthread_mutex_unlock (&pool->lock);
+  return NULL;
+  }
+
+
+/*============================================================================
+  batch_convert_parallel
+  Convert the input in chunks of whole lines, using a pool of 
+  options->threads workers. The calling thread reads the chunks and writes
+  the results, in the order of the input, so the output is the same as 
+  that of a single thread. No more than two chunks per worker are in
+  memory at once.
+============================================================================*/
+static int batch_convert_parallel (BatchInput *input, const char *to,
+    const BatchOptions *options)
+  {
+  BatchPool pool;
+  Converter converter;
+  pthread_t *threads;
+  long n_written = 0;
+  BOOL more = TRUE;
+  int i, n_threads = 0, status = 0, err = 0;
+
+  memset (&pool, 0, sizeof (pool));
+  pool.options = options;
+  pool.to = to;
+  pool.input = input;
+  pool.n_chunks = 2 * options->threads;
+  pool.chunks = calloc (pool.n_chunks, sizeof (BatchChunk));
+  pthread_mutex_init (&pool.lock, NULL);
+  pthread_cond_init (&pool.job_ready, NULL);
+  pthread_cond_init (&pool.chunk_done, NULL);
+
+  threads = malloc (options->threads * sizeof (pthread_t));
+  for (i = 0; i < options->threads; i++)
+    {
+    // pthread_create returns its error, rather than setting errno
+    err = pthread_create (&threads[n_threads], NULL, batch_worker, &pool);
+    if (err != 0) break;
+    n_threads++;
+    }
+
+  batch_converter_init (&converter, options);
+
+  if (n_threads == 0)
+    {
+    fprintf (stderr, "Can't start worker threads: %s\n", strerror (err));
+    status = 1;
+    more = FALSE;
+    }
+
+  for (;;)
+    {
+    // Keep every chunk busy...
+    while (more && pool.n_read - n_written < pool.n_chunks)
+      {
+      BatchChunk *chunk = &pool.chunks[pool.n_read % pool.n_chunks];
+      if (!(more = batch_next_chunk (input, chunk)))
+        break;
+      pthread_mutex_lock (&pool.lock);
+      chunk->converted = FALSE;
+      pool.n_read++;
+      pthread_cond_signal (&pool.job_ready);
+      pthread_mutex_unlock (&pool.lock);
+      }
+
+    if (n_written == pool.n_read) break;
+
+    // ... and write out the oldest when it is ready
+    BatchChunk *chunk = &pool.chunks[n_written % pool.n_chunks];
+    pthread_mutex_lock (&pool.lock);
+    while (!chunk->converted)
+      pthread_cond_wait (&pool.chunk_done, &pool.lock);
+    pthread_mutex_unlock (&pool.lock);
+
+    status |= batch_write_chunk (chunk, &converter, to, options);
+    n_written++;
+    }
+
+  pthread_mutex_lock (&pool.lock);
+  pool.finished = TRUE;
+  pthread_cond_broadcast (&pool.job_ready);
+  pthread_mutex_unlock (&pool.lock);
+  for (i = 0; i < n_threads; i++)
+    pthread_join (threads[i], NULL);
+
+  for (i = 0; i < pool.n_chunks; i++)
+    free (pool.chunks[i].buffer);
+  free (pool.chunks);
+  free (threads);
+  pthread_mutex_destroy (&pool.lock);
+  pthread_cond_destroy (&pool.job_ready);
+  pthread_cond_destroy (&pool.chunk_done);
+  converter_destroy (&converter);
+  return status;
+  }
+
+
+/*============================================================================
+  batch_convert_file
+  Convert each line of "in" to the units "to", printing the results in 
+  the order of the input. A regular file is mapped into memory and its 
+  lines parsed in place; anything else is read as a stream. With more 
+  than one thread in the options, the work is shared by a pool of threads.
+============================================================================*/
+int batch_convert_file (FILE *in, const char *to, 
+    const BatchOptions *options)
+  {
+  static char out_buffer[STREAM_BUFFER_SIZE];
+  BatchInput input;
+  int status;
+
+  memset (&input, 0, sizeof (input));
+  input.file = in;
+  batch_map_input (&input);
+  setvbuf (stdout, out_buffer, _IOFBF, sizeof (out_buffer));
+
+  if (options->threads > 1)
+    status = batch_convert_parallel (&input, to, options);
+  else if (input.map)
+    {
+    Converter converter;
+    batch_converter_init (&converter, options);
+    status = batch_convert_lines (&converter, input.map, input.map_length,
+      to, options, stdout, stderr);
+    converter_destroy (&converter);
+    }
+  else
+    status = batch_convert_stream (in, to, options);
+
+  if (ferror (in))
+    {
+    fprintf (stderr, "Error reading input: %s\n", strerror (errno));
+    status = 1;
+    }
+
+  if (input.map_base) munmap (input.map_base, input.map_size);
+  free (input.carry);
+  fflush (stdout);
+  return status;
+  }
+
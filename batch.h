@@ -0,0 +1,91 @@
+/*============================================================================
+  batch.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include "converter.h"
+
+// Size of the stdout buffer used when converting a stream of values. Output
+//  is flushed only when this fills, or at the end of the input
+#define STREAM_BUFFER_SIZE (256 * 1024)
+
+// Input is divided into chunks of about this size, at line boundaries, for
+//  conversion by worker threads
+#define BATCH_CHUNK_SIZE (1024 * 1024)
+
+// Most worker threads that -j can ask for; each has two chunks of memory
+#define BATCH_MAX_THREADS 256
+
+// Counts and timings of a batch of conversions, for --stats
+typedef struct _BatchStats
+  {
+  unsigned long lines;      // Lines or values read
+  double format_time;       // Formatting and writing results, in seconds
+  ConverterStats converter;
+  } BatchStats;
+
+// The figures that can be gathered from a batch of results, with --sum
+//  and the like, in place of printing each result
+typedef enum 
+  { 
+  batch_count = 1, batch_sum = 2, batch_min = 4, batch_max = 8, 
+  batch_mean = 16 
+  } BatchFigure;
+
+// The results of a batch of conversions, gathered as they are made. The
+//  sum is compensated: its value is sum + compensation, which holds the
+//  low-order parts that a plain sum would lose.
+typedef struct _BatchAggregate
+  {
+  int figures;          // The BatchFigures to print
+  unsigned long count;
+  double sum;
+  double compensation;
+  double min;
+  double max;
+  Units units;          // Of the figures, which results are converted to
+                        //  if they differ
+  Units other;          // The last units that differed, if any
+  UnitsPlan plan;       // From other to units
+  } BatchAggregate;
+
+// How the results of a batch of conversions are to be printed
+typedef struct _BatchOptions
+  {
+  BOOL default_to_iec;
+  BOOL force_decimal;
+  UnitsNumberFormat number_format;
+  BOOL autocorrect;   // Read a misspelt unit name as the closest one
+  BOOL humanize;      // Print results with the prefix that suits them
+  int threads;        // Worker threads for batch_convert_file
+  BatchStats *stats;  // Where to record statistics, or NULL
+  BatchAggregate *aggregate; // Where to gather results instead of 
+                      //  printing them, or NULL
+  } BatchOptions;
+
+void batch_converter_init (Converter *converter, 
+  const BatchOptions *options);
+void batch_stats_add (BatchStats *self, const BatchStats *other);
+void batch_aggregate_init (BatchAggregate *self, int figures,
+  const Units *units);
+void batch_aggregate_value (BatchAggregate *self, const Units *units,
+  double value);
+void batch_aggregate_add (BatchAggregate *self, const BatchAggregate *other);
+int batch_aggregate_print (const BatchAggregate *self, 
+  const BatchOptions *options, FILE *out, FILE *err);
+void batch_print (const Converter *converter, double value, double res,
+  const BatchOptions *options, FILE *out);
+int batch_convert (Converter *converter, const char *from,
+  const char *from_units_suffix, const char *to,
+  const BatchOptions *options, FILE *out, FILE *err);
+int batch_convert_line (Converter *converter, const char *line, 
+  size_t length, const char *to, const BatchOptions *options, FILE *out, 
+  FILE *err);
+int batch_convert_file (FILE *in, const char *to, 
+  const BatchOptions *options);
+
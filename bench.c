@@ -0,0 +1,553 @@
+/*============================================================================
+  bench.c
+
+  Benchmarks for the parts of uconv that matter to its speed: parsing
+  units, planning and applying conversions, formatting, and the whole
+  conversion of one line of input. Each benchmark is run for long enough
+  to be timed reliably, and reported as one line of JSON, giving the time
+  and number of memory allocations per operation. Allocations are counted
+  by stats.c, as they are for --stats, or reported as null where they 
+  can't be.
+
+  Usage: uconv-bench [-t seconds] [name...]
+
+  If names are given, only the benchmarks whose names start with one of
+  them are run.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "units.h"
+#include "converter.h"
+#include "batch.h"
+#include "scan.h"
+#include "stats.h"
+
+static double min_seconds = 0.25;
+static int n_filters = 0;
+static char **filters = NULL;
+
+// Results are added to this so that the compiler can't discard the work
+static volatile double sink;
+
+static FILE *devnull;
+
+/*============================================================================
+  bench_now
+============================================================================*/
+static double bench_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+
+/*============================================================================
+  bench_run
+  Time a benchmark. "body" performs the operation n times. The number of
+  operations is doubled until they take at least min_seconds, and the
+  last run is reported.
+============================================================================*/
+static void bench_run (const char *name,
+    void (*body) (const void *arg, long n), const void *arg)
+  {
+  long n = 1;
+  double elapsed;
+  unsigned long allocated, before, after;
+  BOOL counted = FALSE;
+  int i;
+
+  for (i = 0; i < n_filters; i++)
+    if (strncmp (name, filters[i], strlen (filters[i])) == 0) break;
+  if (n_filters > 0 && i == n_filters) return;
+
+  for (;;)
+    {
+    counted = stats_allocations (&before);
+    double start = bench_now ();
+    body (arg, n);
+    elapsed = bench_now () - start;
+    stats_allocations (&after);
+    allocated = after - before;
+    if (elapsed >= min_seconds) break;
+    // Aim a little beyond the target, rather than doubling blindly
+    n = elapsed > min_seconds / 100
+      ? (long)(n * min_seconds * 1.2 / elapsed) : n * 2;
+    }
+
+  printf ("{\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.3f, "
+    "\"ops_per_sec\": %.0f, \"allocs_per_op\": ", name, n,
+    elapsed * 1e9 / n, n / elapsed);
+  if (counted)
+    printf ("%.3f}\n", (double)allocated / n);
+  else
+    printf ("null}\n");
+  fflush (stdout);
+  }
+
+
+/*============================================================================
+  bench_parse_units
+  Parse units or fail; the benchmarks are meaningless if the input is
+  wrong.
+============================================================================*/
+static void bench_parse_units (Units *units, const char *text)
+  {
+  char error[MAX_ERROR_STRING];
+  if (!units_parse_into (units, text, error, sizeof (error)))
+    {
+    fprintf (stderr, "Bad units in benchmark '%s': %s\n", text, error);
+    exit (1);
+    }
+  }
+
+
+/*============================================================================
+  parse benchmarks
+============================================================================*/
+static void bench_parse (const void *arg, long n)
+  {
+  const char *text = arg;
+  char *error = NULL;
+  for (long i = 0; i < n; i++)
+    {
+    Units *units = units_parse (text, &error);
+    sink += units->n_elements;
+    units_free (units);
+    }
+  }
+
+static void bench_parse_into (const void *arg, long n)
+  {
+  const char *text = arg;
+  char error[MAX_ERROR_STRING];
+  Units units;
+  for (long i = 0; i < n; i++)
+    {
+    units_parse_into (&units, text, error, sizeof (error));
+    sink += units.n_elements;
+    }
+  }
+
+
+// A misspelt name, which is looked up, not found, and compared with the
+//  names that are close to it
+static void bench_parse_unknown (const void *arg, long n)
+  {
+  const char *text = arg;
+  char error[MAX_ERROR_STRING];
+  Units units;
+  for (long i = 0; i < n; i++)
+    sink += units_parse_into (&units, text, error, sizeof (error));
+  }
+
+
+/*============================================================================
+  convert benchmarks
+============================================================================*/
+typedef struct _BenchCase
+  {
+  const char *name;
+  const char *from;
+  const char *to;
+  } BenchCase;
+
+typedef struct _BenchPair
+  {
+  Units fu;
+  Units tu;
+  UnitsPlan plan;
+  } BenchPair;
+
+static void bench_pair_init (BenchPair *self, const BenchCase *c)
+  {
+  char *error = NULL;
+  bench_parse_units (&self->fu, c->from);
+  bench_parse_units (&self->tu, c->to);
+  if (!units_plan_init (&self->plan, &self->fu, &self->tu, &error))
+    {
+    fprintf (stderr, "Bad conversion in benchmark %s: %s\n", c->name,
+      error);
+    exit (1);
+    }
+  }
+
+static void bench_convert (const void *arg, long n)
+  {
+  const BenchPair *pair = arg;
+  char *error = NULL;
+  for (long i = 0; i < n; i++)
+    sink += units_convert ((double)i, &pair->fu, &pair->tu, &error);
+  }
+
+static void bench_plan_apply (const void *arg, long n)
+  {
+  const BenchPair *pair = arg;
+  double total = 0;
+  for (long i = 0; i < n; i++)
+    total += units_plan_apply (&pair->plan, (double)i);
+  sink += total;
+  }
+
+static void bench_convert_array (const void *arg, long n)
+  {
+  const BenchPair *pair = arg;
+  double values[1024];
+  for (int i = 0; i < 1024; i++) values[i] = i;
+  for (long done = 0; done < n; done += 1024)
+    units_convert_array (values, values, n - done < 1024 ? n - done : 1024,
+      &pair->plan);
+  sink += values[0];
+  }
+
+
+/*============================================================================
+  format benchmarks
+============================================================================*/
+static void bench_format (const void *arg, long n)
+  {
+  const BenchPair *pair = arg;
+  char s[MAX_FORMATTED_UNITS + MAX_NUMBER_STRING];
+  for (long i = 0; i < n; i++)
+    {
+    units_format_value (s, sizeof (s), &pair->tu, 1234.5678 + i, FALSE,
+      units_format_general);
+    sink += s[0];
+    }
+  }
+
+static void bench_format_roundtrip (const void *arg, long n)
+  {
+  const BenchPair *pair = arg;
+  char s[MAX_FORMATTED_UNITS + MAX_NUMBER_STRING];
+  for (long i = 0; i < n; i++)
+    {
+    units_format_value (s, sizeof (s), &pair->tu, 1234.5678 + i, TRUE,
+      units_format_roundtrip);
+    sink += s[0];
+    }
+  }
+
+// Values from 1 to 2^60, or from 1 down to 2^-40, in the units of a 
+//  pair's "to" units, rescaled and formatted as --humanize does
+static void bench_humanize (const void *arg, long n)
+  {
+  const BenchPair *pair = arg;
+  char s[MAX_FORMATTED_UNITS + MAX_NUMBER_STRING];
+  BOOL small = pair->tu.units[0].unit == second;
+  for (long i = 0; i < n; i++)
+    {
+    Units tu = pair->tu;
+    double x = ldexp (1.0 + (i & 1023) / 1024.0, small ? -(int)(i % 40) :
+      (int)(i % 60));
+    x = units_humanize (&tu, x, TRUE);
+    units_format_value (s, sizeof (s), &tu, x, FALSE, units_format_general);
+    sink += s[0];
+    }
+  }
+
+
+/*============================================================================
+  end-to-end benchmarks
+  These convert text to text as uconv does, printing to /dev/null.
+============================================================================*/
+static const BatchOptions bench_options =
+  {
+  .default_to_iec = TRUE,
+  .force_decimal = FALSE,
+  .number_format = units_format_general,
+  .threads = 1
+  };
+
+static void bench_e2e_line (const void *arg, long n)
+  {
+  const char *line = arg;
+  size_t length = strlen (line);
+  Converter converter;
+  converter_init (&converter, TRUE);
+  for (long i = 0; i < n; i++)
+    batch_convert_line (&converter, line, length, "mi", &bench_options,
+      devnull, stderr);
+  converter_destroy (&converter);
+  }
+
+static void bench_e2e_separate (const void *arg, long n)
+  {
+  (void)arg;
+  Converter converter;
+  converter_init (&converter, TRUE);
+  for (long i = 0; i < n; i++)
+    batch_convert (&converter, "12.5", "km", "mi", &bench_options,
+      devnull, stderr);
+  converter_destroy (&converter);
+  }
+
+static void bench_e2e_changing (const void *arg, long n)
+  {
+  (void)arg;
+  static const char *lines[] = { "12.5km", "3 ft", "100 yd", "2.5 mi" };
+  Converter converter;
+  converter_init (&converter, TRUE);
+  for (long i = 0; i < n; i++)
+    {
+    const char *line = lines[i & 3];
+    batch_convert_line (&converter, line, strlen (line), "m",
+      &bench_options, devnull, stderr);
+    }
+  converter_destroy (&converter);
+  }
+
+static void bench_e2e_subdivide (const void *arg, long n)
+  {
+  (void)arg;
+  Converter converter;
+  converter_init (&converter, TRUE);
+  for (long i = 0; i < n; i++)
+    batch_convert (&converter, "12.5", "km", "ft", &bench_options,
+      devnull, stderr);
+  converter_destroy (&converter);
+  }
+
+static void bench_e2e_sum (const void *arg, long n)
+  {
+  const char *line = arg;
+  size_t length = strlen (line);
+  BatchOptions options = bench_options;
+  BatchAggregate aggregate;
+  Converter converter;
+  Units units;
+  char *error = NULL;
+  converter_init (&converter, TRUE);
+  converter_parse_target (&converter, "mi", &units, &error);
+  batch_aggregate_init (&aggregate, batch_sum | batch_mean, &units);
+  options.aggregate = &aggregate;
+  for (long i = 0; i < n; i++)
+    batch_convert_line (&converter, line, length, "mi", &options,
+      devnull, stderr);
+  batch_aggregate_print (&aggregate, &options, devnull, stderr);
+  converter_destroy (&converter);
+  }
+
+
+/*============================================================================
+  scan benchmarks
+  Each operation scans BENCH_SCAN_SIZE bytes of text for quantities, as
+  --scan does, and writes the result to /dev/null. The text is made of 
+  one line repeated.
+============================================================================*/
+#define BENCH_SCAN_SIZE (64 * 1024)
+
+typedef struct _BenchText
+  {
+  char *text;
+  size_t length;
+  } BenchText;
+
+static void bench_text_init (BenchText *self, const char *line)
+  {
+  size_t l = strlen (line);
+  self->text = malloc (BENCH_SCAN_SIZE);
+  for (self->length = 0; self->length + l <= BENCH_SCAN_SIZE; 
+      self->length += l)
+    memcpy (self->text + self->length, line, l);
+  }
+
+static void bench_scan (const void *arg, long n)
+  {
+  const BenchText *text = arg;
+  static char *targets[] = { "s", "GB" };
+  Scanner scanner;
+  char *error = NULL;
+  scan_init (&scanner, 2, targets, &bench_options, &error);
+  for (long i = 0; i < n; i++)
+    scan_text (&scanner, text->text, text->length, devnull);
+  scan_destroy (&scanner);
+  }
+
+
+/*============================================================================
+  main
+============================================================================*/
+int main (int argc, char **argv)
+  {
+  static const char *parse_cases[][2] =
+    {
+    { "simple", "m" },
+    { "prefixed", "megajoule" },
+    { "square", "sqft" },
+    { "cubic", "cubic foot" },
+    { "ratio", "km/hour" },
+    { "compound10", "kg.m2/s3/A/K/cd/Bq/coul/lm/lx" },
+    };
+
+  // One conversion for each family of units in the conversion table
+  static const BenchCase families[] =
+    {
+    { "temperature_rate", "K/hour", "F/min" },
+    { "mass", "kg", "lb" },
+    { "length", "km", "mi" },
+    { "volume", "gallon", "l" },
+    { "area", "acre", "hectare" },
+    { "time", "day", "min" },
+    { "force", "lbf", "N" },
+    { "pressure", "psi", "bar" },
+    { "energy", "btu", "kJ" },
+    { "power", "hp", "kW" },
+    { "fuel_economy", "mpg", "lhk" },
+    { "velocity", "mph", "kmh" },
+    { "solid_angle", "steradian", "sterads" },
+    { "angle", "deg", "radian" },
+    { "current", "A", "mA" },
+    { "charge", "faraday", "coul" },
+    { "activity", "curie", "Bq" },
+    { "exposure", "roentgen", "coul/kg" },
+    { "dose", "gray", "rad" },
+    { "luminous_intensity", "candela", "cp" },
+    { "luminance", "lambert", "fL" },
+    { "luminous_flux", "lumen", "W" },
+    { "illuminance", "footcandle", "lux" },
+    { "data", "gib", "mb" },
+    { "compound", "N.m/s", "hp" },
+    };
+
+  static const BenchCase temperatures[] =
+    {
+    { "c_to_f", "C", "F" },
+    { "k_to_c", "K", "C" },
+    { "f_to_k", "F", "K" },
+    };
+
+  static const BenchCase plain[] =
+    {
+    { "plain", "m", "km" },
+    { "compound", "W", "N.m/s" },
+    };
+
+  // Units whose output is subdivided, as "1 foot, 3 inches"
+  static const BenchCase subdivided[] =
+    {
+    { "length", "m", "mi" },
+    { "time", "s", "hour" },
+    { "mass", "kg", "ton" },
+    { "volume", "l", "gallon" },
+    { "angle", "radian", "dms" },
+    };
+
+  // Units rescaled for --humanize
+  static const BenchCase humanize[] =
+    {
+    { "bytes", "B", "B" },
+    { "seconds", "s", "s" },
+    };
+
+#define N_CASES(a) (sizeof (a) / sizeof (a[0]))
+  BenchPair humanize_pairs[N_CASES (humanize)];
+  BenchPair family_pairs[N_CASES (families)];
+  BenchPair temperature_pairs[N_CASES (temperatures)];
+  BenchPair plain_pairs[N_CASES (plain)];
+  BenchPair subdivided_pairs[N_CASES (subdivided)];
+  char name[100];
+  size_t i;
+  int a;
+
+  for (a = 1; a < argc; a++)
+    {
+    if (strcmp (argv[a], "-t") == 0 && a + 1 < argc)
+      min_seconds = atof (argv[++a]);
+    else if (argv[a][0] == '-')
+      {
+      fprintf (stderr, "Usage: %s [-t seconds] [name...]\n", argv[0]);
+      return 1;
+      }
+    else
+      break;
+    }
+  filters = argv + a;
+  n_filters = argc - a;
+
+  devnull = fopen ("/dev/null", "w");
+  units_init ();
+  stats_count_allocations ();
+
+  for (i = 0; i < N_CASES (parse_cases); i++)
+    {
+    Units check;
+    bench_parse_units (&check, parse_cases[i][1]);
+    snprintf (name, sizeof (name), "parse/%s", parse_cases[i][0]);
+    bench_run (name, bench_parse, parse_cases[i][1]);
+    snprintf (name, sizeof (name), "parse_into/%s", parse_cases[i][0]);
+    bench_run (name, bench_parse_into, parse_cases[i][1]);
+    }
+  bench_run ("parse_into/unknown", bench_parse_unknown, "kilometrs");
+
+  for (i = 0; i < N_CASES (families); i++)
+    {
+    bench_pair_init (&family_pairs[i], &families[i]);
+    snprintf (name, sizeof (name), "convert/%s", families[i].name);
+    bench_run (name, bench_convert, &family_pairs[i]);
+    }
+
+  bench_run ("plan_apply/linear", bench_plan_apply, &family_pairs[2]);
+  bench_run ("plan_apply/inverse", bench_plan_apply, &family_pairs[10]);
+  bench_run ("convert_array/linear", bench_convert_array, &family_pairs[2]);
+
+  for (i = 0; i < N_CASES (temperatures); i++)
+    {
+    bench_pair_init (&temperature_pairs[i], &temperatures[i]);
+    snprintf (name, sizeof (name), "temperature/convert/%s",
+      temperatures[i].name);
+    bench_run (name, bench_convert, &temperature_pairs[i]);
+    snprintf (name, sizeof (name), "temperature/plan_apply/%s",
+      temperatures[i].name);
+    bench_run (name, bench_plan_apply, &temperature_pairs[i]);
+    }
+  bench_run ("temperature/convert_array", bench_convert_array,
+    &temperature_pairs[0]);
+
+  for (i = 0; i < N_CASES (plain); i++)
+    {
+    bench_pair_init (&plain_pairs[i], &plain[i]);
+    snprintf (name, sizeof (name), "format/%s", plain[i].name);
+    bench_run (name, bench_format, &plain_pairs[i]);
+    }
+  bench_run ("format/roundtrip", bench_format_roundtrip, &plain_pairs[0]);
+  for (i = 0; i < N_CASES (humanize); i++)
+    bench_pair_init (&humanize_pairs[i], &humanize[i]);
+  bench_run ("format/humanize_bytes", bench_humanize, &humanize_pairs[0]);
+  bench_run ("format/humanize_seconds", bench_humanize, &humanize_pairs[1]);
+
+  for (i = 0; i < N_CASES (subdivided); i++)
+    {
+    bench_pair_init (&subdivided_pairs[i], &subdivided[i]);
+    snprintf (name, sizeof (name), "subdivide/%s", subdivided[i].name);
+    bench_run (name, bench_format, &subdivided_pairs[i]);
+    }
+
+  bench_run ("e2e/concatenated", bench_e2e_line, "12.5km");
+  bench_run ("e2e/separate", bench_e2e_separate, NULL);
+  bench_run ("e2e/fraction", bench_e2e_line, "3 1/2 km");
+  bench_run ("e2e/changing_units", bench_e2e_changing, NULL);
+  bench_run ("e2e/subdivide", bench_e2e_subdivide, NULL);
+  bench_run ("e2e/sum", bench_e2e_sum, "12.5km");
+
+  BenchText prose, log;
+  bench_text_init (&prose, 
+    "The request handler goes on with the work of the queue as before,\n");
+  bench_text_init (&log,
+    "2026-10-17 12:00:01 INFO req 42 took 417 ms, sent 85.5MiB to host-3\n");
+  bench_run ("scan/prose_64k", bench_scan, &prose);
+  bench_run ("scan/log_64k", bench_scan, &log);
+  free (prose.text);
+  free (log.text);
+
+  fclose (devnull);
+  return 0;
+  }
+
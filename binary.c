@@ -0,0 +1,437 @@
+/*============================================================================
+  binary.c
+
+  Conversion of arrays of binary floating-point values, with no text
+  parsing or formatting. Values are little-endian float64 or float32,
+  unless the input is a NumPy .npy file, whose header gives the type and
+  byte order; the header is copied to the output unchanged. A file can
+  also be converted in place, through a writable mapping.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "binary.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BINARY_HOST_BIG_ENDIAN TRUE
+#else
+#define BINARY_HOST_BIG_ENDIAN FALSE
+#endif
+
+// Values are converted this many at a time
+#define BINARY_BLOCK 512
+
+static const char npy_magic[] = "\x93NUMPY";
+
+// The layout of the values
+typedef struct _BinaryFormat
+  {
+  BinaryType type;
+  size_t size;          // Of one value, in bytes
+  BOOL swap;            // Byte order differs from ours
+  size_t header_length; // Of the .npy header, or zero
+  size_t n_values;      // In the .npy array, as its shape says
+  } BinaryFormat;
+
+
+/*============================================================================
+  binary_format_init
+============================================================================*/
+static void binary_format_init (BinaryFormat *self, BinaryType type,
+    BOOL big_endian)
+  {
+  self->type = type;
+  self->size = type == binary_float64 ? sizeof (double) : sizeof (float);
+  self->swap = big_endian != BINARY_HOST_BIG_ENDIAN;
+  self->header_length = 0;
+  self->n_values = 0;
+  }
+
+
+/*============================================================================
+  binary_find_key
+  Find the value of a key in the text of a .npy header, which is written
+  as a Python dict. Returns a pointer to the start of the value, or NULL
+  if the key is not there.
+============================================================================*/
+static const char *binary_find_key (const char *text, const char *end,
+    const char *key)
+  {
+  size_t l = strlen (key);
+  const char *p;
+
+  for (p = text; p + l + 2 <= end; p++)
+    {
+    if ((*p == '\'' || *p == '"') && p[l + 1] == *p &&
+        memcmp (p + 1, key, l) == 0)
+      {
+      p += l + 2;
+      while (p < end && (*p == ' ' || *p == ':')) p++;
+      return p;
+      }
+    }
+  return NULL;
+  }
+
+
+/*============================================================================
+  binary_parse_shape
+  Read the shape of a .npy array, such as "(3, 4)", and set the number 
+  of values in it, which is the product of its dimensions: 1 for the
+  shape "()" of a single value. Returns FALSE if the shape can't be read.
+============================================================================*/
+static BOOL binary_parse_shape (BinaryFormat *self, const char *p, 
+    const char *end)
+  {
+  size_t n = 1;
+
+  if (!p || p == end || *p != '(') return FALSE;
+  for (p++; p < end; p++)
+    {
+    if (*p == ')')
+      {
+      self->n_values = n;
+      return TRUE;
+      }
+    if (*p == ' ' || *p == ',') continue;
+    if (*p < '0' || *p > '9') return FALSE;
+
+    size_t d = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+      {
+      if (d > (SIZE_MAX - 9) / 10) return FALSE;
+      d = d * 10 + (*p - '0');
+      }
+    if (d != 0 && n > SIZE_MAX / d) return FALSE;
+    n *= d;
+    p--;
+    }
+  return FALSE;
+  }
+
+
+/*============================================================================
+  binary_parse_npy_header
+  If the data starts with a .npy header, set the format from it. Returns
+  FALSE, with an error message, if the header is incomplete or describes
+  anything other than an array of float32 or float64.
+============================================================================*/
+static BOOL binary_parse_npy_header (BinaryFormat *self,
+    const unsigned char *data, size_t length, const char *name)
+  {
+  size_t prefix, header;
+
+  if (length < 8 || memcmp (data, npy_magic, 6) != 0) return TRUE;
+
+  if (data[6] == 1 && length >= 10)
+    {
+    prefix = 10;
+    header = data[8] | (size_t)data[9] << 8;
+    }
+  else if ((data[6] == 2 || data[6] == 3) && length >= 12)
+    {
+    prefix = 12;
+    header = data[8] | (size_t)data[9] << 8 | (size_t)data[10] << 16
+      | (size_t)data[11] << 24;
+    }
+  else
+    {
+    fprintf (stderr, "%s: Unsupported .npy version\n", name);
+    return FALSE;
+    }
+
+  if (header > length - prefix)
+    {
+    fprintf (stderr, "%s: Incomplete .npy header\n", name);
+    return FALSE;
+    }
+
+  // The header is a Python dict, such as
+  //  {'descr': '<f8', 'fortran_order': False, 'shape': (3,), }
+  // The order of the array makes no difference when each value is 
+  //  converted by itself, but the shape says how many values there are
+  const char *text = (const char *)data + prefix, *end = text + header;
+  const char *p = binary_find_key (text, end, "descr");
+  if (!p || p + 5 > end || (*p != '\'' && *p != '"') || p[4] != *p ||
+      !strchr ("<>=", p[1]) || p[2] != 'f' || (p[3] != '4' && p[3] != '8'))
+    {
+    fprintf (stderr, "%s: Only .npy arrays of float32 or float64 values "
+      "can be converted\n", name);
+    return FALSE;
+    }
+
+  binary_format_init (self, p[3] == '8' ? binary_float64 : binary_float32,
+    p[1] == '>' || (p[1] == '=' && BINARY_HOST_BIG_ENDIAN));
+  if (!binary_parse_shape (self, binary_find_key (text, end, "shape"), end))
+    {
+    fprintf (stderr, "%s: The .npy header has no valid shape\n", name);
+    return FALSE;
+    }
+  self->header_length = prefix + header;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  binary_check_count
+  Check that a .npy file holds as many values as its shape says. Returns
+  FALSE, with an error message, if it does not.
+============================================================================*/
+static BOOL binary_check_count (const BinaryFormat *format, size_t n,
+    const char *name)
+  {
+  if (format->header_length == 0 || n == format->n_values) return TRUE;
+  fprintf (stderr, "%s: Holds %zu values, but its .npy header says %zu\n",
+    name, n, format->n_values);
+  return FALSE;
+  }
+
+
+/*============================================================================
+  binary_load
+============================================================================*/
+static inline double binary_load (const BinaryFormat *format,
+    const unsigned char *p)
+  {
+  if (format->type == binary_float64)
+    {
+    uint64_t u;
+    double d;
+    memcpy (&u, p, sizeof (u));
+    if (format->swap) u = __builtin_bswap64 (u);
+    memcpy (&d, &u, sizeof (d));
+    return d;
+    }
+  else
+    {
+    uint32_t u;
+    float f;
+    memcpy (&u, p, sizeof (u));
+    if (format->swap) u = __builtin_bswap32 (u);
+    memcpy (&f, &u, sizeof (f));
+    return f;
+    }
+  }
+
+
+/*============================================================================
+  binary_store
+============================================================================*/
+static inline void binary_store (const BinaryFormat *format,
+    unsigned char *p, double d)
+  {
+  if (format->type == binary_float64)
+    {
+    uint64_t u;
+    memcpy (&u, &d, sizeof (u));
+    if (format->swap) u = __builtin_bswap64 (u);
+    memcpy (p, &u, sizeof (u));
+    }
+  else
+    {
+    uint32_t u;
+    float f = (float)d;
+    memcpy (&u, &f, sizeof (u));
+    if (format->swap) u = __builtin_bswap32 (u);
+    memcpy (p, &u, sizeof (u));
+    }
+  }
+
+
+/*============================================================================
+  binary_convert_values
+  Convert n values in place. Aligned float64 values in our own byte order
+  are converted where they are; anything else is converted a block at a
+  time through a buffer of doubles.
+============================================================================*/
+static void binary_convert_values (const BinaryFormat *format,
+    unsigned char *data, size_t n, const UnitsPlan *plan)
+  {
+  double buffer[BINARY_BLOCK];
+  size_t i, done, count;
+
+  if (format->type == binary_float64 && !format->swap &&
+      (uintptr_t)data % _Alignof (double) == 0)
+    {
+    units_convert_array ((double *)data, (double *)data, n, plan);
+    return;
+    }
+
+  for (done = 0; done < n; done += count)
+    {
+    unsigned char *p = data + done * format->size;
+    count = n - done < BINARY_BLOCK ? n - done : BINARY_BLOCK;
+    for (i = 0; i < count; i++)
+      buffer[i] = binary_load (format, p + i * format->size);
+    units_convert_array (buffer, buffer, count, plan);
+    for (i = 0; i < count; i++)
+      binary_store (format, p + i * format->size, buffer[i]);
+    }
+  }
+
+
+/*============================================================================
+  binary_convert_stream
+  Convert the values read from "in", writing them to stdout.
+============================================================================*/
+static int binary_convert_stream (FILE *in, const char *name,
+    BinaryFormat *format, const UnitsPlan *plan)
+  {
+  unsigned char *buffer = malloc (BINARY_BUFFER_SIZE);
+  size_t length = fread (buffer, 1, BINARY_BUFFER_SIZE, in), n, total = 0;
+  int status = 0;
+
+  if (!binary_parse_npy_header (format, buffer, length, name))
+    status = 1;
+  else
+    {
+    fwrite (buffer, 1, format->header_length, stdout);
+    length -= format->header_length;
+    memmove (buffer, buffer + format->header_length, length);
+
+    for (;;)
+      {
+      n = length / format->size;
+      binary_convert_values (format, buffer, n, plan);
+      if (fwrite (buffer, format->size, n, stdout) != n) break;
+      total += n;
+      length -= n * format->size;
+      memmove (buffer, buffer + n * format->size, length);
+
+      size_t more = fread (buffer + length, 1, BINARY_BUFFER_SIZE - length,
+        in);
+      if (more == 0) break;
+      length += more;
+      }
+
+    if (length > 0 && !ferror (in) && !ferror (stdout))
+      {
+      fprintf (stderr, "%s: Ends with a partial value of %d bytes\n", name,
+        (int)length);
+      status = 1;
+      }
+    else if (!ferror (in) && !ferror (stdout) &&
+        !binary_check_count (format, total, name))
+      status = 1;
+    }
+
+  if (ferror (in))
+    {
+    fprintf (stderr, "%s: %s\n", name, strerror (errno));
+    status = 1;
+    }
+  if (fflush (stdout) != 0)
+    {
+    fprintf (stderr, "Error writing output: %s\n", strerror (errno));
+    status = 1;
+    }
+
+  free (buffer);
+  return status;
+  }
+
+
+/*============================================================================
+  binary_convert_in_place
+  Convert the values in a file, by mapping it for writing.
+============================================================================*/
+static int binary_convert_in_place (const char *name, BinaryFormat *format,
+    const UnitsPlan *plan)
+  {
+  int fd = open (name, O_RDWR);
+  struct stat sb;
+  int status = 0;
+
+  if (fd < 0 || fstat (fd, &sb) != 0)
+    {
+    fprintf (stderr, "%s: %s\n", name, strerror (errno));
+    if (fd >= 0) close (fd);
+    return 1;
+    }
+  if (!S_ISREG (sb.st_mode))
+    {
+    fprintf (stderr, "%s: Only a regular file can be converted in place\n",
+      name);
+    close (fd);
+    return 1;
+    }
+  if (sb.st_size == 0)
+    {
+    close (fd);
+    return 0;
+    }
+
+  unsigned char *map = mmap (NULL, sb.st_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    {
+    fprintf (stderr, "%s: %s\n", name, strerror (errno));
+    return 1;
+    }
+
+  if (!binary_parse_npy_header (format, map, sb.st_size, name))
+    status = 1;
+  else
+    {
+    size_t length = sb.st_size - format->header_length;
+    if (length % format->size != 0)
+      {
+      // Don't change anything if the file is not what it should be
+      fprintf (stderr, "%s: Ends with a partial value of %d bytes\n", name,
+        (int)(length % format->size));
+      status = 1;
+      }
+    else if (!binary_check_count (format, length / format->size, name))
+      status = 1;
+    else
+      binary_convert_values (format, map + format->header_length,
+        length / format->size, plan);
+    }
+
+  if (munmap (map, sb.st_size) != 0)
+    {
+    fprintf (stderr, "%s: %s\n", name, strerror (errno));
+    status = 1;
+    }
+  return status;
+  }
+
+
+/*============================================================================
+  binary_convert_file
+  Apply a plan to the binary values in the named file, or stdin for "-",
+  which are of the given type unless the file has a .npy header. The
+  results are written to stdout, or back to the file if "in_place" is set.
+============================================================================*/
+int binary_convert_file (const char *name, BinaryType type, BOOL in_place,
+    const UnitsPlan *plan)
+  {
+  BinaryFormat format;
+  binary_format_init (&format, type, FALSE);
+
+  if (in_place)
+    return binary_convert_in_place (name, &format, plan);
+
+  FILE *in = strcmp (name, "-") == 0 ? stdin : fopen (name, "rb");
+  if (!in)
+    {
+    fprintf (stderr, "%s: %s\n", name, strerror (errno));
+    return 1;
+    }
+
+  int status = binary_convert_stream (in, name, &format, plan);
+  if (in != stdin) fclose (in);
+  return status;
+  }
+
@@ -0,0 +1,23 @@
+/*============================================================================
+  binary.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include "units.h"
+
+// Input and output are read and written in blocks of this size
+#define BINARY_BUFFER_SIZE (1024 * 1024)
+
+typedef enum
+  {
+  binary_float64 = 0,
+  binary_float32
+  } BinaryType;
+
+int binary_convert_file (const char *name, BinaryType type, BOOL in_place,
+  const UnitsPlan *plan);
+
@@ -0,0 +1,754 @@
+/*============================================================================
+  converter.c
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include "converter.h"
+
+typedef enum {
+  no_prefix,
+  iec_prefix,
+  si_prefix,
+  digital_storage_prefix_enum_count,
+} DigitalStoragePrefixType;
+
+
+/*============================================================================
+  data_unit_type
+============================================================================*/
+static int data_unit_type (Unit u)
+  {
+  switch (u)
+    {
+    case kibibyte:
+    case mebibyte:
+    case gibibyte:
+    case tebibyte:
+    case pebibyte:
+    case exbibyte:
+    case kibibit:
+    case mebibit:
+    case gibibit:
+    case tebibit:
+    case pebibit:
+    case exbibit:
+      return iec_prefix;
+
+    case kilobyte:
+    case megabyte:
+    case gigabyte:
+    case terabyte:
+    case petabyte:
+    case exabyte:
+    case kilobit:
+    case megabit:
+    case gigabit:
+    case terabit:
+    case petabit:
+    case exabit:
+      return si_prefix;
+
+    default:
+      return no_prefix;
+    }
+  }
+
+
+/*============================================================================
+  si_to_iec
+============================================================================*/
+static Unit si_to_iec (Unit u)
+  {
+  switch (u)
+    {
+    case kilobyte: return kibibyte;
+    case megabyte: return mebibyte;
+    case gigabyte: return gibibyte;
+    case terabyte: return tebibyte;
+    case petabyte: return pebibyte;
+    case exabyte: return exbibyte;
+    case kilobit: return kibibit;
+    case megabit: return mebibit;
+    case gigabit: return gibibit;
+    case terabit: return tebibit;
+    case petabit: return pebibit;
+    case exabit: return exbibit;
+    default: return u;
+    }
+  }
+
+
+/*============================================================================
+  number parsing
+  Numbers are read in a single pass, without scanf. The decimal digits are
+  gathered into a 64-bit integer; when that holds no more than 53 bits, and
+  the power of ten is one that a double holds exactly, a single multiply or
+  divide gives the correctly rounded result. Anything else -- very long
+  or very large numbers, infinities and hexadecimal -- is left to strtod.
+  The text need not be NUL-terminated: nothing at or beyond "limit" is 
+  read, so numbers can be parsed in place in a read-only buffer.
+============================================================================*/
+
+static const double exact_powers_of_ten[] =
+  {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+  1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+
+/*============================================================================
+  skip_space
+============================================================================*/
+static const char *skip_space (const char *s, const char *limit)
+  {
+  while (s < limit && IS_SPACE (*s)) s++;
+  return s;
+  }
+
+
+/*============================================================================
+  scan_strtod
+  Call strtod on the text from s to limit, which need not be NUL-terminated.
+  Only the characters that could be part of a number are copied for it,
+  so that a word such as "INFO", followed by a long line, is rejected 
+  without copying the line.
+============================================================================*/
+static const char *scan_strtod (const char *s, const char *limit, 
+    double *value)
+  {
+  char buffer[64], *copy = buffer, *end;
+  const char *p = s;
+
+  while (p < limit && (isalnum ((unsigned char)*p) || *p == '.' || 
+      *p == '+' || *p == '-' || *p == '(' || *p == ')' || *p == '_'))
+    p++;
+  size_t length = p - s;
+
+  if (length >= sizeof (buffer)) copy = malloc (length + 1);
+  memcpy (copy, s, length);
+  copy[length] = 0;
+  *value = strtod (copy, &end);
+  s += end - copy;
+  if (copy != buffer) free (copy);
+  return s;
+  }
+
+
+/*============================================================================
+  scan_decimal
+  Read a number -- an optional sign, digits with an optional decimal point,
+  and an optional exponent -- from the start of s, stopping at limit.
+  Returns a pointer to the character after it, or s itself if there is no
+  number. *integer is set if the number has neither a point nor an exponent.
+============================================================================*/
+static const char *scan_decimal (const char *s, const char *limit,
+    double *value, BOOL *integer)
+  {
+  const char *p = s;
+  BOOL negative = FALSE, any_digits = FALSE, inexact = FALSE;
+  uint64_t mantissa = 0;
+  int digits = 0;     // Significant digits in mantissa
+  int exponent = 0;   // Power of ten by which to multiply mantissa
+
+  if (p < limit && (*p == '+' || *p == '-')) negative = (*p++ == '-');
+
+  if (p < limit && (*p == 'i' || *p == 'I' || *p == 'n' || *p == 'N' ||
+      (p[0] == '0' && p + 1 < limit && (p[1] == 'x' || p[1] == 'X'))))
+    {
+    *integer = FALSE;
+    return scan_strtod (s, limit, value);
+    }
+
+  *integer = TRUE;
+  for (; p < limit && IS_DIGIT (*p); p++)
+    {
+    any_digits = TRUE;
+    if (digits < 19)
+      {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa) digits++;
+      }
+    else
+      {
+      if (*p != '0') inexact = TRUE;
+      exponent++;
+      }
+    }
+
+  if (p < limit && *p == '.')
+    {
+    *integer = FALSE;
+    for (p++; p < limit && IS_DIGIT (*p); p++)
+      {
+      any_digits = TRUE;
+      if (digits < 19)
+        {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa) digits++;
+        exponent--;
+        }
+      else if (*p != '0') 
+        inexact = TRUE;
+      }
+    }
+
+  if (!any_digits) return s;
+
+  if (p < limit && (*p == 'e' || *p == 'E'))
+    {
+    const char *q = p + 1;
+    BOOL negative_exponent = FALSE;
+    int e = 0;
+    if (q < limit && (*q == '+' || *q == '-')) 
+      negative_exponent = (*q++ == '-');
+    if (q < limit && IS_DIGIT (*q))
+      {
+      for (; q < limit && IS_DIGIT (*q); q++)
+        if (e < 100000) e = e * 10 + (*q - '0');
+      exponent += negative_exponent ? -e : e;
+      *integer = FALSE;
+      p = q;
+      }
+    }
+
+#if FLT_EVAL_METHOD == 0
+  if (!inexact && mantissa <= (1ULL << 53) && exponent >= -22 && 
+      exponent <= 22)
+    {
+    double v = (double) mantissa;
+    v = exponent >= 0 ? v * exact_powers_of_ten[exponent] 
+      : v / exact_powers_of_ten[-exponent];
+    *value = negative ? -v : v;
+    return p;
+    }
+#endif
+
+  if (mantissa == 0)
+    *value = negative ? -0.0 : 0.0;
+  else
+    scan_strtod (s, p, value);
+  return p;
+  }
+
+
+/*============================================================================
+  scan_fraction
+  Read "b/c", with optional spaces around the "/", from the start of s. 
+  Returns a pointer to the character after it, or s itself if there is no
+  fraction.
+============================================================================*/
+static const char *scan_fraction (const char *s, const char *limit,
+    double *numerator, double *denominator)
+  {
+  BOOL dummy;
+  const char *p = scan_decimal (s, limit, numerator, &dummy);
+  if (p == s) return s;
+  p = skip_space (p, limit);
+  if (p == limit || *p != '/') return s;
+  p = skip_space (p + 1, limit);
+  const char *end = scan_decimal (p, limit, denominator, &dummy);
+  return end == p ? s : end;
+  }
+
+
+/*============================================================================
+  scan_number
+  fractod for the text from "text" to "limit", which need not be 
+  NUL-terminated.
+============================================================================*/
+static double scan_number (const char *text, const char *limit,
+    const char **endptr)
+  {
+  const char *start = skip_space (text, limit), *p, *q, *end = text;
+  double a, b, c, result = 0;
+  BOOL integer;
+
+  p = scan_decimal (start, limit, &a, &integer);
+  if (p == start)
+    {
+    if (text == limit) errno = EINVAL;
+    }
+  else if ((q = scan_fraction (start, limit, &b, &c)) != start)
+    {
+    // a/b
+    if (c <= 0)
+      errno = EINVAL;
+    else
+      {
+      result = b / c;
+      end = skip_space (q, limit);
+      errno = 0;
+      }
+    }
+  else if (integer && p < limit && IS_SPACE (*p) && 
+      (q = skip_space (p, limit)) < limit && IS_DIGIT (*q) &&
+      (q = scan_fraction (skip_space (p, limit), limit, &b, &c)) 
+        != skip_space (p, limit))
+    {
+    // a b/c
+    if (b < 0 || c <= 0 || b > c)
+      errno = EINVAL;
+    else
+      {
+      result = a + (signbit (a) ? -b / c : b / c);
+      end = skip_space (q, limit);
+      errno = 0;
+      }
+    }
+  else
+    {
+    result = a;
+    end = skip_space (p, limit);
+    errno = 0;
+    }
+
+  *endptr = end;
+  return result;
+  }
+
+
+/*============================================================================
+  fractod
+  Like strtod(3) but also handles fractions in the form of "a/b" and "a b/c".
+  Leading and trailing white space is skipped. Sets errno to EINVAL for an 
+  empty string or a malformed fraction, and to zero for a valid number.
+============================================================================*/
+double fractod (const char *text, char **endptr)
+  {
+  const char *end;
+  double result = scan_number (text, text + strlen (text), &end);
+  if (endptr)
+    *endptr = (char *)end;
+  return result;
+  }
+
+
+/*============================================================================
+  fractodn
+  As fractod, for the "length" bytes at "text", which need not be 
+  NUL-terminated.
+============================================================================*/
+double fractodn (const char *text, size_t length, char **endptr)
+  {
+  const char *end;
+  double result = scan_number (text, text + length, &end);
+  if (endptr)
+    *endptr = (char *)end;
+  return result;
+  }
+
+
+/*============================================================================
+  converter_init
+============================================================================*/
+void converter_init (Converter *self, BOOL default_to_iec)
+  {
+  memset (self, 0, sizeof (Converter));
+  self->default_to_iec = default_to_iec;
+  }
+
+
+/*============================================================================
+  converter_destroy
+============================================================================*/
+void converter_destroy (Converter *self)
+  {
+  free (self->from_units_suffix);
+  free (self->to);
+  free (self->correction);
+  free (self->failed_from);
+  free (self->failed_to);
+  free (self->failed_error);
+  memset (self, 0, sizeof (Converter));
+  }
+
+
+/*============================================================================
+  converter_move
+  Replace the state of self with that of other, which is left empty. No
+  strings are copied; self takes over those that other owned. Self goes
+  on recording statistics where it did before, if anywhere.
+============================================================================*/
+void converter_move (Converter *self, Converter *other)
+  {
+  ConverterStats *stats = self->stats;
+  converter_destroy (self);
+  *self = *other;
+  self->stats = stats;
+  memset (other, 0, sizeof (Converter));
+  }
+
+
+/*============================================================================
+  converter_hash
+  A hash of a pair of units, as given, for choosing one of a set of 
+  Converters; units that are written the same way share a Converter, and
+  so a plan.
+============================================================================*/
+unsigned converter_hash (const char *from_units_suffix, const char *to)
+  {
+  unsigned h = 2166136261u;
+  for (; *from_units_suffix; from_units_suffix++)
+    h = (h ^ (unsigned char)*from_units_suffix) * 16777619u;
+  h *= 16777619u;
+  for (; *to; to++)
+    h = (h ^ (unsigned char)*to) * 16777619u;
+  return h;
+  }
+
+
+/*============================================================================
+  converter_stats_add
+  Add the counts and times in other to those in self.
+============================================================================*/
+void converter_stats_add (ConverterStats *self, const ConverterStats *other)
+  {
+  int i;
+  for (i = 0; i < converter_status_enum_count; i++)
+    self->results[i] += other->results[i];
+  self->plans += other->plans;
+  self->number_time += other->number_time;
+  self->units_time += other->units_time;
+  self->plan_time += other->plan_time;
+  }
+
+
+/*============================================================================
+  converter_now
+  A monotonic time in seconds, for statistics.
+============================================================================*/
+static double converter_now (void)
+  {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+
+/*============================================================================
+  converter_record
+  Count the outcome of a conversion, if statistics are wanted, and return
+  it.
+============================================================================*/
+static inline ConverterStatus converter_record (Converter *self, 
+    ConverterStatus status)
+  {
+  if (self->stats) self->stats->results[status]++;
+  return status;
+  }
+
+
+/*============================================================================
+  converter_prefer_iec
+  When defaulting to IEC units, only convert to IEC units if all inputs
+  are SI units. This allows conversion of SI to IEC by mixing unit types
+  e.g. "10 gb gib". fu may be NULL, for units taken on their own.
+============================================================================*/
+static void converter_prefer_iec (Units *fu, Units *tu)
+  {
+  int i, counts[digital_storage_prefix_enum_count] = {0};
+
+  for (i = 0; fu && i < fu->n_elements; i++)
+    counts[data_unit_type (fu->units[i].unit)]++;
+
+  for (i = 0; i < tu->n_elements; i++)
+    counts[data_unit_type (tu->units[i].unit)]++;
+
+  if (counts[si_prefix] && !counts[iec_prefix])
+    {
+    for (i = 0; fu && i < fu->n_elements; i++)
+      fu->units[i].unit = si_to_iec (fu->units[i].unit);
+
+    for (i = 0; i < tu->n_elements; i++)
+      tu->units[i].unit = si_to_iec (tu->units[i].unit);
+    }
+  }
+
+
+/*============================================================================
+  converter_parse_target
+  Parse units to convert to, on their own, as they would be read if the
+  units converted from had no say in it: when defaulting to IEC units,
+  SI units of data are read as IEC units unless IEC units are mixed in.
+  Results whose units depend on those converted from, as "GB" does, can 
+  then all be brought into the same units. Returns FALSE, and sets 
+  *error, if the units can't be parsed.
+============================================================================*/
+BOOL converter_parse_target (const Converter *self, const char *to,
+    Units *units, char **error)
+  {
+  char message[MAX_ERROR_STRING], correction[MAX_ERROR_STRING];
+  BOOL parsed = self->autocorrect 
+    ? units_parse_corrected (units, to, correction, sizeof (correction),
+        message, sizeof (message))
+    : units_parse_into (units, to, message, sizeof (message));
+  if (!parsed)
+    {
+    *error = strdup (message);
+    return FALSE;
+    }
+  if (self->default_to_iec) converter_prefer_iec (NULL, units);
+  return TRUE;
+  }
+
+
+/*============================================================================
+  converter_plan_units
+  Parse the "from" and "to" units and work out how to convert between them.
+  On success, the results replace those of the previous conversion. The
+  units are parsed into storage on the stack, so nothing is allocated
+  unless the units are valid, or there is an error to report.
+============================================================================*/
+static ConverterStatus converter_plan_units (Converter *self, 
+    const char *from_units_suffix, const char *to, char **error)
+  {
+  Units fu, tu;
+  UnitsPlan plan;
+  char message[MAX_ERROR_STRING];
+  double start = self->stats ? converter_now () : 0;
+
+  BOOL parsed;
+  char correction[2 * MAX_ERROR_STRING] = "";
+  if (self->autocorrect)
+    {
+    char to_correction[MAX_ERROR_STRING];
+    parsed = units_parse_corrected (&fu, from_units_suffix, correction,
+        MAX_ERROR_STRING, message, sizeof (message)) && 
+      units_parse_corrected (&tu, to, to_correction, sizeof (to_correction),
+        message, sizeof (message));
+    if (parsed && to_correction[0])
+      {
+      if (correction[0]) strcat (correction, ", ");
+      strcat (correction, to_correction);
+      }
+    }
+  else
+    parsed = units_parse_into (&fu, from_units_suffix, message, 
+        sizeof (message)) && units_parse_into (&tu, to, message, 
+        sizeof (message));
+  if (self->stats)
+    {
+    double now = converter_now ();
+    self->stats->units_time += now - start;
+    start = now;
+    }
+  if (!parsed)
+    {
+    *error = strdup (message);
+    return converter_bad_units;
+    }
+
+  if (self->default_to_iec) converter_prefer_iec (&fu, &tu);
+
+  BOOL planned = units_plan_init (&plan, &fu, &tu, error);
+  if (self->stats)
+    {
+    self->stats->plan_time += converter_now () - start;
+    self->stats->plans++;
+    }
+  if (!planned) return converter_incompatible_units;
+
+  // Copy the strings before releasing the old ones: from_units_suffix
+  //  might be the stored string itself
+  char *new_from = strdup (from_units_suffix);
+  char *new_to = strdup (to);
+  free (self->from_units_suffix);
+  free (self->to);
+  self->from_units_suffix = new_from;
+  self->to = new_to;
+  self->fu = fu;
+  self->tu = tu;
+  self->plan = plan;
+  self->planned = TRUE;
+  if (correction[0])
+    {
+    free (self->correction);
+    self->correction = strdup (correction);
+    }
+  return converter_ok;
+  }
+
+
+/*============================================================================
+  converter_plan
+  As converter_plan_units, but units that failed the last time they were
+  planned fail again at once, with the same error. An unknown unit name
+  is costly to report, as the closest names are searched for, and a 
+  stream may have it on many lines.
+============================================================================*/
+static ConverterStatus converter_plan (Converter *self, 
+    const char *from_units_suffix, const char *to, char **error)
+  {
+  if (self->failed_error && strcmp (self->failed_from, 
+      from_units_suffix) == 0 && strcmp (self->failed_to, to) == 0)
+    {
+    *error = strdup (self->failed_error);
+    return self->failed_status;
+    }
+
+  ConverterStatus status = converter_plan_units (self, from_units_suffix,
+    to, error);
+  if (status != converter_ok)
+    {
+    free (self->failed_from);
+    free (self->failed_to);
+    free (self->failed_error);
+    self->failed_from = strdup (from_units_suffix);
+    self->failed_to = strdup (to);
+    self->failed_error = strdup (*error);
+    self->failed_status = status;
+    }
+  return status;
+  }
+
+
+/*============================================================================
+  converter_bad_number_error
+============================================================================*/
+static char *converter_bad_number_error (const char *text, int length,
+    int err)
+  {
+  const char *reason = "Not a valid number";
+  char buffer[MAX_ERROR_STRING];
+  if (err != 0)
+    {
+    // strerror is not required to be thread-safe, and converters may be
+    //  used from any number of threads
+    if (strerror_r (err, buffer, sizeof (buffer)) != 0)
+      snprintf (buffer, sizeof (buffer), "Error %d", err);
+    reason = buffer;
+    }
+  char *s = malloc (length + strlen (reason) + 3);
+  sprintf (s, "%.*s: %s", length, text, reason);
+  return s;
+  }
+
+
+/*============================================================================
+  converter_convert_text
+  As converter_convert, for a value and its units concatenated, or a value
+  alone, which takes the "from" units of the last successful conversion. 
+  The text is the "length" bytes at "from"; it need not be NUL-terminated,
+  and is not modified, so it can be parsed in place in a read-only buffer
+  such as a mapped file. Trailing white space is not removed from the 
+  units.
+============================================================================*/
+ConverterStatus converter_convert_text (Converter *self, const char *from,
+    size_t length, const char *to, double *value, double *result, 
+    char **error)
+  {
+  const char *limit = from + length, *end, *suffix;
+  size_t suffix_length;
+  double start = self->stats ? converter_now () : 0;
+  errno = 0;
+
+  *value = scan_number (from, limit, &end);
+  if (self->stats) self->stats->number_time += converter_now () - start;
+  if (errno != 0 || from == end)
+    {
+    // Don't include units in the error
+    int l = from == end ? (int)length : end - from;
+    *error = converter_bad_number_error (from, l, errno);
+    return converter_record (self, converter_bad_number);
+    }
+
+  if (end == limit)
+    {
+    if (!self->from_units_suffix)
+      {
+      char *s = malloc (length + 50);
+      sprintf (s, "No units specified for input value '%.*s'", 
+        (int)length, from);
+      *error = s;
+      return converter_record (self, converter_no_units);
+      }
+
+    // If the "from" value does not include units but a previous call did, we
+    // reuse the units from the previous call.
+    suffix = self->from_units_suffix;
+    suffix_length = strlen (suffix);
+    }
+  else
+    {
+    suffix = end;
+    suffix_length = limit - end;
+    }
+
+  if (!self->planned || strncmp (self->from_units_suffix, suffix, 
+      suffix_length) != 0 || self->from_units_suffix[suffix_length] != 0 
+      || strcmp (to, self->to) != 0)
+    {
+    char *from_units_suffix = strndup (suffix, suffix_length);
+    ConverterStatus status = converter_plan (self, from_units_suffix, to, 
+      error);
+    free (from_units_suffix);
+    if (status != converter_ok) return converter_record (self, status);
+    }
+
+  *result = units_plan_apply (&self->plan, *value);
+  return converter_record (self, converter_ok);
+  }
+
+
+/*============================================================================
+  converter_convert
+  Perform a conversion of one unit to another. If the value and units are
+  separate strings, they are passed in as "from" and "from_units_suffix",
+  respectively. If they are concatenated, "from" should point to the whole
+  string while "from_units_suffix" should be set to NULL. On success, the
+  value read from "from" and the converted value are stored, and the
+  units of both are left in self->fu and self->tu for formatting. On
+  failure, *error is set to a message that the caller must free.
+============================================================================*/
+ConverterStatus converter_convert (Converter *self, const char *from,
+    const char *from_units_suffix, const char *to, double *value,
+    double *result, char **error)
+  {
+  char *end;
+
+  if (!from_units_suffix)
+    return converter_convert_text (self, from, strlen (from), to, value,
+      result, error);
+
+  double start = self->stats ? converter_now () : 0;
+  errno = 0;
+  *value = fractod (from, &end);
+  if (self->stats) self->stats->number_time += converter_now () - start;
+  if (errno != 0)
+    {
+    int l = from == end ? (int)strlen (from) : end - from;
+    *error = converter_bad_number_error (from, l, errno);
+    return converter_record (self, converter_bad_number);
+    }
+  if (*end != '\0')
+    {
+    *error = converter_bad_number_error (end, strlen (end), 0);
+    return converter_record (self, converter_bad_number);
+    }
+
+  if (!self->planned || strcmp (from_units_suffix, self->from_units_suffix) != 0
+      || strcmp (to, self->to) != 0)
+    {
+    ConverterStatus status = converter_plan (self, from_units_suffix, to, 
+      error);
+    if (status != converter_ok) return converter_record (self, status);
+    }
+
+  *result = units_plan_apply (&self->plan, *value);
+  return converter_record (self, converter_ok);
+  }
+
@@ -0,0 +1,73 @@
+/*============================================================================
+  converter.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include "units.h"
+
+typedef enum
+  {
+  converter_ok = 0,
+  converter_bad_number,   // The value could not be read as a number
+  converter_no_units,     // No units given, and none to carry forward
+  converter_bad_units,    // Units could not be parsed
+  converter_incompatible_units, // Units are of different dimensions
+  converter_status_enum_count
+  } ConverterStatus;
+
+// Counts and timings of the work done by a Converter, if it is given
+//  somewhere to record them. Times are in seconds.
+typedef struct _ConverterStats
+  {
+  unsigned long results[converter_status_enum_count]; // Calls, by outcome
+  unsigned long plans;    // Times the units were parsed and reduced
+  double number_time;     // Reading numbers
+  double units_time;      // Parsing units, and looking up their names
+  double plan_time;       // Reducing units to a plan
+  } ConverterStats;
+
+// All the state needed to convert a sequence of values. The units and plan
+//  of the last successful conversion are kept, and reused for as long as
+//  the units don't change, so a batch of values in the same units is parsed
+//  and reduced only once. The last "from" units are also the default for a
+//  value given without units. A Converter belongs to its caller; any number
+//  of them can be used at the same time, from different threads.
+typedef struct _Converter
+  {
+  BOOL default_to_iec;
+  char *from_units_suffix;
+  char *to;
+  BOOL planned;   // TRUE if fu, tu and plan are valid
+  Units fu;
+  Units tu;
+  UnitsPlan plan;
+  ConverterStats *stats;  // Where to record statistics, or NULL
+  BOOL autocorrect;       // Read a misspelt unit name as the closest one
+  char *correction;       // What autocorrect changed when the units were 
+                          //  last planned, until the caller takes it
+  char *failed_from;      // The last units that could not be planned,
+  char *failed_to;        //  and why, or NULL
+  char *failed_error;
+  ConverterStatus failed_status;
+  } Converter;
+
+void converter_init (Converter *self, BOOL default_to_iec);
+void converter_destroy (Converter *self);
+void converter_move (Converter *self, Converter *other);
+void converter_stats_add (ConverterStats *self, const ConverterStats *other);
+BOOL converter_parse_target (const Converter *self, const char *to,
+  Units *units, char **error);
+unsigned converter_hash (const char *from_units_suffix, const char *to);
+ConverterStatus converter_convert (Converter *self, const char *from,
+  const char *from_units_suffix, const char *to, double *value,
+  double *result, char **error);
+ConverterStatus converter_convert_text (Converter *self, const char *from,
+  size_t length, const char *to, double *value, double *result, 
+  char **error);
+double fractod (const char *text, char **endptr);
+double fractodn (const char *text, size_t length, char **endptr);
+
@@ -0,0 +1,464 @@
+/*============================================================================
+  csv.c
+
+  Conversion of columns of values in CSV or TSV files. Each column to be
+  converted has its units planned once, and its fields are then just
+  parsed, scaled and printed; every other byte of the input is copied to
+  the output unchanged. CSV fields may be quoted, as in RFC 4180, and a 
+  quoted field may span lines; TSV fields are never quoted.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "csv.h"
+
+// The columns to convert, indexed by column number
+typedef struct _CsvTable
+  {
+  char separator;
+  BOOL quoting;
+  CsvColumn **by_index;
+  int n_indices;
+  } CsvTable;
+
+
+/*============================================================================
+  csv_column_parse
+  Parse a column specification -- "{column}:{from}:{to}", or 
+  "{column}:{to}" to take the "from" units from the header. The column is 
+  a number, counting from 1, or a name in the header.
+============================================================================*/
+BOOL csv_column_parse (CsvColumn *self, const char *spec, char **error)
+  {
+  const char *colon1 = strchr (spec, ':');
+  const char *colon2 = colon1 ? strchr (colon1 + 1, ':') : NULL;
+
+  memset (self, 0, sizeof (CsvColumn));
+
+  if (!colon1 || colon1 == spec || colon1[1] == 0 || 
+      (colon2 && (colon2 == colon1 + 1 || colon2[1] == 0 || 
+        strchr (colon2 + 1, ':'))))
+    {
+    char *s = malloc (strlen (spec) + 80);
+    sprintf (s, "Bad column '%s': expected {column}:{from}:{to} or "
+      "{column}:{to}", spec);
+    *error = s;
+    return FALSE;
+    }
+
+  self->name = strndup (spec, colon1 - spec);
+  self->index = -1;
+  if (strspn (self->name, "0123456789") == strlen (self->name))
+    {
+    self->index = atoi (self->name) - 1;
+    if (self->index < 0)
+      {
+      char *s = malloc (strlen (spec) + 50);
+      sprintf (s, "Bad column '%s': columns count from 1", spec);
+      *error = s;
+      csv_column_destroy (self);
+      return FALSE;
+      }
+    }
+
+  if (colon2)
+    {
+    self->from = strndup (colon1 + 1, colon2 - colon1 - 1);
+    self->to = strdup (colon2 + 1);
+    }
+  else
+    self->to = strdup (colon1 + 1);
+
+  return TRUE;
+  }
+
+
+/*============================================================================
+  csv_column_destroy
+============================================================================*/
+void csv_column_destroy (CsvColumn *self)
+  {
+  free (self->name);
+  free (self->from);
+  free (self->to);
+  converter_destroy (&self->converter);
+  memset (self, 0, sizeof (CsvColumn));
+  }
+
+
+/*============================================================================
+  csv_column_plan
+  Work out how to convert a column, once its "from" units are known.
+============================================================================*/
+static BOOL csv_column_plan (CsvColumn *self, BOOL default_to_iec)
+  {
+  double value, res;
+  char *error = NULL;
+
+  converter_init (&self->converter, default_to_iec);
+  if (converter_convert (&self->converter, "1", self->from, self->to,
+      &value, &res, &error) != converter_ok)
+    {
+    fprintf (stderr, "Column %s: %s\n", self->name, error);
+    free (error);
+    return FALSE;
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  csv_field_end
+  Find the end of the field that starts at p. A separator or newline 
+  inside quotes does not end a field.
+============================================================================*/
+static const char *csv_field_end (const CsvTable *table, const char *p, 
+    const char *end)
+  {
+  BOOL quoted = FALSE;
+  for (; p < end; p++)
+    {
+    if (*p == '"' && table->quoting)
+      quoted = !quoted;
+    else if (*p == table->separator && !quoted)
+      break;
+    }
+  return p;
+  }
+
+
+/*============================================================================
+  csv_unquote
+  Remove the quotes from around a field, if it has them.
+============================================================================*/
+static size_t csv_unquote (const CsvTable *table, const char **field, 
+    size_t length)
+  {
+  if (table->quoting && length >= 2 && (*field)[0] == '"' && 
+      (*field)[length - 1] == '"')
+    {
+    (*field)++;
+    length -= 2;
+    }
+  return length;
+  }
+
+
+/*============================================================================
+  csv_annotation
+  Find the units annotation, in square brackets, at the end of a header 
+  field. Returns a pointer to the "[", or NULL if there is none.
+============================================================================*/
+static const char *csv_annotation (const char *field, size_t length)
+  {
+  while (length > 0 && isspace ((int)field[length - 1])) length--;
+  if (length == 0 || field[length - 1] != ']') return NULL;
+  for (const char *p = field + length - 1; p > field; p--)
+    if (p[-1] == '[') return p - 1;
+  return NULL;
+  }
+
+
+/*============================================================================
+  csv_record_end
+  Find the end of the record -- usually a single line -- that starts at p, 
+  excluding the line terminator.
+============================================================================*/
+static const char *csv_record_end (const char *p, const char *end)
+  {
+  if (end > p && end[-1] == '\n') end--;
+  if (end > p && end[-1] == '\r') end--;
+  return end;
+  }
+
+
+/*============================================================================
+  csv_read_record
+  Read the next record into *record, which is reallocated as needed. A
+  record is one line, unless a quoted field runs on to the next. *lines
+  is increased by the number of lines read. Returns the length of the 
+  record, or -1 at the end of the input.
+============================================================================*/
+static ssize_t csv_read_record (const CsvTable *table, FILE *in, 
+    char **record, size_t *size, long *lines)
+  {
+  ssize_t length = getline (record, size, in);
+  if (length > 0) (*lines)++;
+  if (length <= 0 || !table->quoting) return length;
+
+  char *more = NULL;
+  size_t more_size = 0;
+  ssize_t more_length;
+  for (;;)
+    {
+    int quotes = 0;
+    for (ssize_t i = 0; i < length; i++)
+      if ((*record)[i] == '"') quotes++;
+    if (quotes % 2 == 0) break;
+
+    if ((more_length = getline (&more, &more_size, in)) <= 0) break;
+    (*lines)++;
+    if (length + more_length + 1 > (ssize_t)*size)
+      {
+      *size = length + more_length + 1;
+      *record = realloc (*record, *size);
+      }
+    memcpy (*record + length, more, more_length + 1);
+    length += more_length;
+    }
+  free (more);
+  return length;
+  }
+
+
+/*============================================================================
+  csv_convert_field
+  Convert one field and print the result. A blank field is copied 
+  unchanged, as is one that is not a number, after reporting an error.
+============================================================================*/
+static int csv_convert_field (const CsvTable *table, CsvColumn *column,
+    const char *field, size_t length, long line, 
+    const BatchOptions *options)
+  {
+  const char *text = field;
+  size_t text_length = csv_unquote (table, &text, length);
+  char *end;
+
+  while (text_length > 0 && isspace ((int)*text)) 
+    {
+    text++;
+    text_length--;
+    }
+  if (text_length == 0)
+    {
+    fwrite (field, 1, length, stdout);
+    return 0;
+    }
+
+  errno = 0;
+  double value = fractodn (text, text_length, &end);
+  if (errno != 0 || end != text + text_length)
+    {
+    fprintf (stderr, "Line %ld, column %s: %.*s: Not a valid number\n", 
+      line, column->name, (int)text_length, text);
+    fwrite (field, 1, length, stdout);
+    if (options->stats) 
+      options->stats->converter.results[converter_bad_number]++;
+    return 1;
+    }
+
+  char s[MAX_NUMBER_STRING];
+  units_format_number (s, sizeof (s), 
+    units_plan_apply (&column->converter.plan, value), 
+    options->number_format);
+  fputs (s, stdout);
+  if (options->stats) options->stats->converter.results[converter_ok]++;
+  return 0;
+  }
+
+
+/*============================================================================
+  csv_convert_record
+  Print a record with the fields in the columns to convert replaced by 
+  their converted values. If "header" is set, it is the header record,
+  and only the units annotations of those columns are changed.
+============================================================================*/
+static int csv_convert_record (const CsvTable *table, const char *record,
+    size_t length, long line, BOOL header, const BatchOptions *options)
+  {
+  const char *end = csv_record_end (record, record + length);
+  const char *p = record, *copied = record;
+  int i, status = 0;
+
+  for (i = 0; i < table->n_indices; i++)
+    {
+    const char *field_end = csv_field_end (table, p, end);
+    CsvColumn *column = table->by_index[i];
+    if (column)
+      {
+      const char *name = p, *annotation = NULL;
+      size_t name_length = 0;
+      if (header)
+        {
+        // The annotation is inside the quotes, if the field has them, and 
+        //  the new one is written back there
+        name_length = csv_unquote (table, &name, field_end - p);
+        annotation = csv_annotation (name, name_length);
+        }
+      if (annotation)
+        {
+        fwrite (copied, 1, annotation + 1 - copied, stdout);
+        fputs (column->to, stdout);
+        copied = memchr (annotation, ']', name + name_length - annotation);
+        }
+      else if (!header)
+        {
+        fwrite (copied, 1, p - copied, stdout);
+        status |= csv_convert_field (table, column, p, field_end - p, line, 
+          options);
+        copied = field_end;
+        }
+      }
+    if (field_end == end) break;
+    p = field_end + 1;
+    }
+
+  fwrite (copied, 1, record + length - copied, stdout);
+  return status;
+  }
+
+
+/*============================================================================
+  csv_resolve_columns
+  Find the numbers of columns given by name, and the "from" units of any
+  left to the header, then plan the conversion of each column. The header
+  is NULL if the input has none.
+============================================================================*/
+static BOOL csv_resolve_columns (CsvTable *table, CsvColumn *columns, 
+    int n_columns, const char *header, size_t length, 
+    const BatchOptions *options)
+  {
+  const char *end = header ? csv_record_end (header, header + length) : NULL;
+  int i;
+
+  for (i = 0; i < n_columns; i++)
+    {
+    CsvColumn *column = &columns[i];
+    const char *p = header;
+    int index = 0;
+
+    while (header && index != column->index)
+      {
+      const char *field_end = csv_field_end (table, p, end);
+      const char *name = p;
+      size_t name_length = csv_unquote (table, &name, field_end - p);
+      const char *annotation = csv_annotation (name, name_length);
+      if (annotation) name_length = annotation - name;
+      while (name_length > 0 && isspace ((int)name[name_length - 1]))
+        name_length--;
+
+      if (column->index < 0 && name_length == strlen (column->name) &&
+          strncmp (name, column->name, name_length) == 0)
+        break;
+      if (field_end == end)
+        {
+        p = NULL;
+        break;
+        }
+      p = field_end + 1;
+      index++;
+      }
+
+    if (column->index < 0)
+      {
+      if (!p)
+        {
+        fprintf (stderr, "Column %s: Not found in the header\n", 
+          column->name);
+        return FALSE;
+        }
+      column->index = index;
+      }
+
+    if (!column->from)
+      {
+      const char *field = p, *annotation = NULL;
+      size_t field_length = 0;
+      if (p)
+        {
+        field_length = csv_unquote (table, &field, 
+          csv_field_end (table, p, end) - p);
+        annotation = csv_annotation (field, field_length);
+        }
+      if (!annotation)
+        {
+        fprintf (stderr, "Column %s: No units given, and none in the "
+          "header\n", column->name);
+        return FALSE;
+        }
+      const char *close = memchr (annotation, ']', 
+        field + field_length - annotation);
+      column->from = strndup (annotation + 1, close - annotation - 1);
+      }
+
+    if (!csv_column_plan (column, options->default_to_iec))
+      return FALSE;
+
+    if (column->index >= table->n_indices)
+      {
+      table->by_index = realloc (table->by_index, 
+        (column->index + 1) * sizeof (CsvColumn *));
+      memset (table->by_index + table->n_indices, 0, 
+        (column->index + 1 - table->n_indices) * sizeof (CsvColumn *));
+      table->n_indices = column->index + 1;
+      }
+    if (table->by_index[column->index])
+      {
+      fprintf (stderr, "Column %s: Given more than once\n", column->name);
+      return FALSE;
+      }
+    table->by_index[column->index] = column;
+    }
+
+  return TRUE;
+  }
+
+
+/*============================================================================
+  csv_convert_file
+  Convert the given columns of a CSV file (or TSV, if the separator is a 
+  tab) read from "in", and print the result. If "header" is set, the 
+  first record names the columns, and may give their units. 
+============================================================================*/
+int csv_convert_file (FILE *in, char separator, CsvColumn *columns,
+    int n_columns, BOOL header, const BatchOptions *options)
+  {
+  static char out_buffer[STREAM_BUFFER_SIZE];
+  CsvTable table;
+  char *record = NULL;
+  size_t size = 0;
+  ssize_t length;
+  long line = 1, next_line = 1;
+  int status = 0;
+
+  memset (&table, 0, sizeof (table));
+  table.separator = separator;
+  table.quoting = separator != '\t';
+  setvbuf (stdout, out_buffer, _IOFBF, sizeof (out_buffer));
+
+  length = header ? csv_read_record (&table, in, &record, &size, &next_line) 
+    : 0;
+  if (!csv_resolve_columns (&table, columns, n_columns, 
+      length > 0 ? record : NULL, length > 0 ? length : 0, options))
+    status = 1;
+  else
+    {
+    if (length > 0)
+      csv_convert_record (&table, record, length, line, TRUE, options);
+
+    while (line = next_line, 
+        (length = csv_read_record (&table, in, &record, &size, 
+          &next_line)) >= 0)
+      status |= csv_convert_record (&table, record, length, line, FALSE, 
+        options);
+    }
+
+  if (ferror (in))
+    {
+    fprintf (stderr, "Error reading input: %s\n", strerror (errno));
+    status = 1;
+    }
+
+  if (options->stats) options->stats->lines += next_line - 1;
+  free (record);
+  free (table.by_index);
+  fflush (stdout);
+  return status;
+  }
+
@@ -0,0 +1,30 @@
+/*============================================================================
+  csv.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include "converter.h"
+#include "batch.h"
+
+// A column of a CSV or TSV file to convert, as given by --col. The column
+//  is identified by its number or by its name in the header; the "from"
+//  units may be left to a header annotation such as "distance[mi]".
+typedef struct _CsvColumn
+  {
+  int index;            // From 0, or -1 if the column is given by name
+  char *name;
+  char *from;           // NULL to take the units from the header
+  char *to;
+  Converter converter;  // Holds the plan, once the units are known
+  } CsvColumn;
+
+BOOL csv_column_parse (CsvColumn *self, const char *spec, char **error);
+void csv_column_destroy (CsvColumn *self);
+int csv_convert_file (FILE *in, char separator, CsvColumn *columns,
+  int n_columns, BOOL header, const BatchOptions *options);
+
@@ -0,0 +1,663 @@
+/*============================================================================
+  json.c
+
+  Conversion of members of JSON records, one record to a line, as in
+  JSON Lines or NDJSON. Each record is scanned once, without building a
+  tree or copying it: only the positions of the members that are asked
+  for are noted, and the record is then written out with their values
+  replaced, and new members added before the closing brace. Every other
+  byte of the record is copied unchanged. Only members of the top-level
+  object are looked at, and their names are compared as they are
+  written, escapes and all.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "json.h"
+
+#define JSON_IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || \
+  (c) == '\r')
+
+// The text of a member's value in a record; start is NULL if the record
+//  does not have the member
+typedef struct _JsonSpan
+  {
+  const char *start;
+  const char *end;
+  } JsonSpan;
+
+// The members of one record that a field refers to
+typedef struct _JsonMembers
+  {
+  JsonSpan value;
+  JsonSpan units;
+  JsonSpan out;
+  JsonSpan out_units;
+  } JsonMembers;
+
+// A change to a record: the value from start to end replaced by text, or,
+//  if start is NULL, a new member with the given name
+typedef struct _JsonEdit
+  {
+  const char *start;
+  const char *end;
+  const char *name;
+  const char *text;
+  BOOL quote;           // Write the text as a JSON string
+  } JsonEdit;
+
+// Storage for one record's worth of work, allocated once for all records
+typedef struct _JsonRecord
+  {
+  JsonMembers *members;         // One for each field
+  JsonEdit *edits;              // Two for each field
+  int n_edits;
+  char (*numbers)[MAX_NUMBER_STRING];  // The results, formatted
+  const char *close;            // The closing brace of the object
+  int n_members;                // In the object as it was read
+  } JsonRecord;
+
+
+/*============================================================================
+  json_field_parse
+  Parse a field specification -- "{field}:{from}:{to}", or "{field}:{to}"
+  to take the units from the value, optionally followed by "={out}" to
+  write the result to a different member. The "from" units may be
+  ".{member}", to take them from another member of the record. Member
+  names may start with a '.', as in jq.
+============================================================================*/
+BOOL json_field_parse (JsonField *self, const char *spec, char **error)
+  {
+  const char *equals = strrchr (spec, '=');
+  char *head = equals ? strndup (spec, equals - spec) : strdup (spec);
+  const char *colon1 = strchr (head, ':');
+  const char *colon2 = colon1 ? strchr (colon1 + 1, ':') : NULL;
+
+  memset (self, 0, sizeof (JsonField));
+
+  if (!colon1 || colon1 == head || colon1[1] == 0 ||
+      (colon2 && (colon2 == colon1 + 1 || colon2[1] == 0 ||
+        strchr (colon2 + 1, ':'))) ||
+      (equals && (equals[1] == 0 || (equals[1] == '.' && equals[2] == 0))) ||
+      (head[0] == '.' && colon1 == head + 1))
+    {
+    char *s = malloc (strlen (spec) + 80);
+    sprintf (s, "Bad field '%s': expected {field}:[{from}:]{to}[={out}]",
+      spec);
+    *error = s;
+    free (head);
+    return FALSE;
+    }
+
+  self->name = head[0] == '.' ? strndup (head + 1, colon1 - head - 1)
+    : strndup (head, colon1 - head);
+  if (colon2)
+    {
+    if (colon1[1] == '.')
+      self->units_name = strndup (colon1 + 2, colon2 - colon1 - 2);
+    else
+      self->from = strndup (colon1 + 1, colon2 - colon1 - 1);
+    self->to = strdup (colon2 + 1);
+    }
+  else
+    self->to = strdup (colon1 + 1);
+
+  // By default the result replaces the value, and the name of its units
+  //  replaces the units, if they were in a member of their own
+  const char *out = equals ? equals + 1 : self->name;
+  if (*out == '.') out++;
+  self->out = strdup (out);
+  if (!equals && self->units_name)
+    self->out_units = strdup (self->units_name);
+  else
+    {
+    self->out_units = malloc (strlen (out) + 6);
+    sprintf (self->out_units, "%s_unit", out);
+    }
+
+  free (head);
+  return TRUE;
+  }
+
+
+/*============================================================================
+  json_field_destroy
+============================================================================*/
+void json_field_destroy (JsonField *self)
+  {
+  free (self->name);
+  free (self->from);
+  free (self->units_name);
+  free (self->to);
+  free (self->out);
+  free (self->out_units);
+  if (self->plans)
+    {
+    int i;
+    for (i = 0; i < JSON_CACHE_SIZE; i++)
+      {
+      converter_destroy (&self->plans[i].converter);
+      free (self->plans[i].canonical);
+      free (self->plans[i].canonical_from);
+      }
+    free (self->plans);
+    }
+  memset (self, 0, sizeof (JsonField));
+  }
+
+
+/*============================================================================
+  json_plan_name_units
+  Name the units of the results, if they have changed since they were
+  last named. They are the "to" units, but for bytes and bits these may
+  depend on the "from" units.
+============================================================================*/
+static void json_plan_name_units (JsonPlan *self)
+  {
+  const char *from = self->converter.from_units_suffix;
+  if (self->canonical && strcmp (self->canonical_from, from) == 0) return;
+  free (self->canonical);
+  free (self->canonical_from);
+  self->canonical = units_format_string (&self->converter.tu, FALSE);
+  self->canonical_from = strdup (from);
+  }
+
+
+/*============================================================================
+  json_field_plan
+  Prepare to convert a field, working out the conversion now if its units
+  are given.
+============================================================================*/
+static BOOL json_field_plan (JsonField *self, const BatchOptions *options)
+  {
+  double value, res;
+  char *error = NULL;
+  int i;
+
+  self->plans = calloc (JSON_CACHE_SIZE, sizeof (JsonPlan));
+  for (i = 0; i < JSON_CACHE_SIZE; i++)
+    converter_init (&self->plans[i].converter, options->default_to_iec);
+  if (!self->from) return TRUE;
+
+  if (converter_convert (&self->plans[0].converter, "1", self->from, 
+      self->to, &value, &res, &error) != converter_ok)
+    {
+    fprintf (stderr, "Field %s: %s\n", self->name, error);
+    free (error);
+    return FALSE;
+    }
+  json_plan_name_units (&self->plans[0]);
+  return TRUE;
+  }
+
+
+/*============================================================================
+  json_check_fields
+  Check that no two fields write the same member, and that no field 
+  writes its result and the name of its units to the same one. Returns
+  FALSE, after reporting the clash, if they do.
+============================================================================*/
+static BOOL json_check_fields (const JsonField *fields, int n_fields)
+  {
+  int i, j;
+
+  for (i = 0; i < 2 * n_fields; i++)
+    {
+    const JsonField *a = &fields[i / 2];
+    const char *name = i % 2 ? a->out_units : a->out;
+    for (j = i + 1; j < 2 * n_fields; j++)
+      {
+      const JsonField *b = &fields[j / 2];
+      if (strcmp (name, j % 2 ? b->out_units : b->out) != 0) continue;
+      if (a == b)
+        fprintf (stderr, "Field %s writes its result and its units to "
+          "member %s\n", a->name, name);
+      else
+        fprintf (stderr, "Fields %s and %s both write member %s\n", 
+          a->name, b->name, name);
+      return FALSE;
+      }
+    }
+  return TRUE;
+  }
+
+
+/*============================================================================
+  json_skip_space
+============================================================================*/
+static inline const char *json_skip_space (const char *p, const char *end)
+  {
+  while (p < end && JSON_IS_SPACE (*p)) p++;
+  return p;
+  }
+
+
+/*============================================================================
+  json_string_end
+  Find the end of the string whose opening quote is at p. Returns a
+  pointer to the character after the closing quote, or NULL if there is
+  none.
+============================================================================*/
+static const char *json_string_end (const char *p, const char *end)
+  {
+  for (p++; p < end; p++)
+    {
+    if (*p == '\\')
+      p++;
+    else if (*p == '"')
+      return p + 1;
+    }
+  return NULL;
+  }
+
+
+/*============================================================================
+  json_value_end
+  Find the end of the value that starts at p: a string, an object or
+  array, with everything in it, or a number or literal. Returns NULL if
+  the value does not end. Values are not checked any further than is
+  needed to find their ends.
+============================================================================*/
+static const char *json_value_end (const char *p, const char *end)
+  {
+  const char *q;
+
+  if (p == end) return NULL;
+  if (*p == '"') return json_string_end (p, end);
+  if (*p == '{' || *p == '[')
+    {
+    int depth = 0;
+    for (; p < end; p++)
+      {
+      if (*p == '"')
+        {
+        if (!(q = json_string_end (p, end))) return NULL;
+        p = q - 1;
+        }
+      else if (*p == '{' || *p == '[')
+        depth++;
+      else if ((*p == '}' || *p == ']') && --depth == 0)
+        return p + 1;
+      }
+    return NULL;
+    }
+
+  for (q = p; q < end && *q != ',' && *q != '}' && *q != ']' &&
+      !JSON_IS_SPACE (*q); q++);
+  return q == p ? NULL : q;
+  }
+
+
+/*============================================================================
+  json_name_is
+  Whether the member name from start to end, without its quotes, is name.
+============================================================================*/
+static inline BOOL json_name_is (const char *start, const char *end,
+    const char *name)
+  {
+  return name && strncmp (start, name, end - start) == 0 &&
+    name[end - start] == 0;
+  }
+
+
+/*============================================================================
+  json_scan_record
+  Find the members of the object in the record that the fields refer to,
+  and its closing brace. Returns FALSE if the record is not an object.
+============================================================================*/
+static BOOL json_scan_record (const JsonField *fields, int n_fields,
+    JsonRecord *record, const char *p, const char *end)
+  {
+  const char *name, *name_end, *value, *value_end;
+  int i;
+
+  memset (record->members, 0, n_fields * sizeof (JsonMembers));
+  record->n_members = 0;
+
+  p = json_skip_space (p, end);
+  if (p == end || *p != '{') return FALSE;
+  p = json_skip_space (p + 1, end);
+  if (p < end && *p == '}')
+    {
+    record->close = p;
+    return json_skip_space (p + 1, end) == end;
+    }
+
+  for (;;)
+    {
+    if (p == end || *p != '"' || !(name_end = json_string_end (p, end)))
+      return FALSE;
+    name = p + 1;
+    name_end--;
+    p = json_skip_space (name_end + 1, end);
+    if (p == end || *p != ':') return FALSE;
+    value = json_skip_space (p + 1, end);
+    if (!(value_end = json_value_end (value, end))) return FALSE;
+
+    for (i = 0; i < n_fields; i++)
+      {
+      JsonMembers *m = &record->members[i];
+      if (json_name_is (name, name_end, fields[i].name))
+        m->value = (JsonSpan){ value, value_end };
+      if (json_name_is (name, name_end, fields[i].units_name))
+        m->units = (JsonSpan){ value, value_end };
+      if (json_name_is (name, name_end, fields[i].out))
+        m->out = (JsonSpan){ value, value_end };
+      if (json_name_is (name, name_end, fields[i].out_units))
+        m->out_units = (JsonSpan){ value, value_end };
+      }
+    record->n_members++;
+
+    p = json_skip_space (value_end, end);
+    if (p < end && *p == ',')
+      p = json_skip_space (p + 1, end);
+    else if (p < end && *p == '}')
+      {
+      record->close = p;
+      return json_skip_space (p + 1, end) == end;
+      }
+    else
+      return FALSE;
+    }
+  }
+
+
+/*============================================================================
+  json_field_error
+  Report a value that can't be converted, and return 1.
+============================================================================*/
+static int json_field_error (const JsonField *field, long line,
+    const char *message, const char *text, int length)
+  {
+  if (text)
+    fprintf (stderr, "Line %ld, field %s: %.*s: %s\n", line, field->name,
+      length, text, message);
+  else
+    fprintf (stderr, "Line %ld, field %s: %s\n", line, field->name,
+      message);
+  return 1;
+  }
+
+
+/*============================================================================
+  json_convert_field
+  Convert the value of a field in a record. Returns 0 and sets *result on
+  success, -1 if the record has no value to convert, or 1 after reporting
+  an error.
+============================================================================*/
+static int json_convert_field (JsonField *field, const JsonMembers *m,
+    long line, double *result, const char **canonical)
+  {
+  const char *text = m->value.start, *units = NULL;
+  size_t length, units_length = 0;
+  double value;
+  char *number_end;
+
+  if (!text || (m->value.end - text == 4 && strncmp (text, "null", 4) == 0))
+    return -1;
+
+  length = m->value.end - text;
+  if (*text == '"')
+    {
+    text++;
+    length -= 2;
+    }
+  else if (*text != '-' && (*text < '0' || *text > '9'))
+    return json_field_error (field, line, "Not a number", text, length);
+  if (memchr (text, '\\', length))
+    return json_field_error (field, line, "Not a number", text, length);
+
+  if (field->from)
+    {
+    // Units given, and already planned
+    errno = 0;
+    value = fractodn (text, length, &number_end);
+    if (errno != 0 || number_end != text + length || length == 0)
+      return json_field_error (field, line, "Not a valid number", text,
+        length);
+    *result = units_plan_apply (&field->plans[0].converter.plan, value);
+    *canonical = field->plans[0].canonical;
+    return 0;
+    }
+
+  if (field->units_name && m->units.start)
+    {
+    // Units in a member of their own
+    if (*m->units.start != '"')
+      {
+      fprintf (stderr, "Line %ld, field %s: Units in member %s are not a "
+        "string\n", line, field->name, field->units_name);
+      return 1;
+      }
+    units = m->units.start + 1;
+    units_length = m->units.end - units - 1;
+    }
+  else
+    {
+    // Units in the value, after the number; a record may have them there
+    //  even if they are expected in a member of their own
+    fractodn (text, length, &number_end);
+    if (number_end == text)
+      return json_field_error (field, line, "Not a valid number", text,
+        length);
+    units = number_end;
+    units_length = text + length - units;
+    length = units - text;
+    }
+  while (units_length > 0 && (units[units_length - 1] == ' ' ||
+      units[units_length - 1] == '\t'))
+    units_length--;
+  if (units_length == 0)
+    return json_field_error (field, line, "No units specified", text,
+      length);
+
+  char number_copy[JSON_MAX_NUMBER], units_copy[MAX_UNIT_STRING];
+  if (length >= sizeof (number_copy) || units_length >= sizeof (units_copy)
+      || memchr (units, '\\', units_length))
+    return json_field_error (field, line, "Too long, or not units", units,
+      units_length);
+  memcpy (number_copy, text, length);
+  number_copy[length] = 0;
+  memcpy (units_copy, units, units_length);
+  units_copy[units_length] = 0;
+
+  // Each set of units has a plan of its own, so values in units that
+  //  change from record to record are not planned again for each one
+  char *error = NULL;
+  JsonPlan *plan = &field->plans[converter_hash (units_copy, field->to) 
+    % JSON_CACHE_SIZE];
+  if (converter_convert (&plan->converter, number_copy, units_copy,
+      field->to, &value, result, &error) != converter_ok)
+    {
+    json_field_error (field, line, error, NULL, 0);
+    free (error);
+    return 1;
+    }
+  json_plan_name_units (plan);
+  *canonical = plan->canonical;
+  return 0;
+  }
+
+
+/*============================================================================
+  json_add_edit
+  Replace the value of a member, or add the member if the record has none.
+============================================================================*/
+static void json_add_edit (JsonRecord *record, const JsonSpan *span,
+    const char *name, const char *text, BOOL quote)
+  {
+  JsonEdit *edit = &record->edits[record->n_edits++];
+  edit->start = span->start;
+  edit->end = span->end;
+  edit->name = name;
+  edit->text = text;
+  edit->quote = quote;
+
+  // Keep the replacements in the order they are in the record, ahead of
+  //  the new members
+  for (; edit > record->edits && edit->start && (!edit[-1].start ||
+      edit[-1].start > edit->start); edit--)
+    {
+    JsonEdit t = edit[-1];
+    edit[-1] = edit[0];
+    edit[0] = t;
+    }
+  }
+
+
+/*============================================================================
+  json_write_string
+  Write text as a JSON string, with quotes.
+============================================================================*/
+static void json_write_string (const char *s, FILE *out)
+  {
+  const char *p = s;
+  while (*p && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+  putc ('"', out);
+  fwrite (s, 1, p - s, out);
+  for (s = p; *s; s++)
+    {
+    if (*s == '"' || *s == '\\')
+      putc ('\\', out);
+    if ((unsigned char)*s < 0x20)
+      fprintf (out, "\\u%04x", *s);
+    else
+      putc (*s, out);
+    }
+  putc ('"', out);
+  }
+
+
+/*============================================================================
+  json_write_record
+  Write a record with its edits made.
+============================================================================*/
+static void json_write_record (const JsonRecord *record, const char *text,
+    size_t length, FILE *out)
+  {
+  const char *copied = text;
+  int i, n_members = record->n_members;
+
+  for (i = 0; i < record->n_edits; i++)
+    {
+    const JsonEdit *edit = &record->edits[i];
+    if (edit->start)
+      {
+      fwrite (copied, 1, edit->start - copied, out);
+      copied = edit->end;
+      }
+    else
+      {
+      fwrite (copied, 1, record->close - copied, out);
+      copied = record->close;
+      if (n_members++ > 0) putc (',', out);
+      json_write_string (edit->name, out);
+      putc (':', out);
+      }
+
+    if (edit->quote)
+      json_write_string (edit->text, out);
+    else
+      fputs (edit->text, out);
+    }
+  fwrite (copied, 1, text + length - copied, out);
+  }
+
+
+/*============================================================================
+  json_convert_file
+  Convert the given fields of each JSON record read from "in", one to a
+  line, and print the records. A record without a field's value, or whose
+  value is null, is printed with that field unchanged; a line that is not
+  a JSON object, or a value that can't be converted, is reported, and
+  printed unchanged.
+============================================================================*/
+int json_convert_file (FILE *in, JsonField *fields, int n_fields,
+    const BatchOptions *options)
+  {
+  static char out_buffer[STREAM_BUFFER_SIZE];
+  JsonRecord record;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  long line_number = 0;
+  int i, status = 0;
+
+  if (!json_check_fields (fields, n_fields)) return 1;
+  setvbuf (stdout, out_buffer, _IOFBF, sizeof (out_buffer));
+  for (i = 0; i < n_fields; i++)
+    if (!json_field_plan (&fields[i], options)) return 1;
+
+  record.members = malloc (n_fields * sizeof (JsonMembers));
+  record.edits = malloc (2 * n_fields * sizeof (JsonEdit));
+  record.numbers = malloc (n_fields * MAX_NUMBER_STRING);
+
+  while ((length = getline (&line, &size, in)) >= 0)
+    {
+    line_number++;
+    if (json_skip_space (line, line + length) == line + length)
+      {
+      fwrite (line, 1, length, stdout);
+      continue;
+      }
+    if (!json_scan_record (fields, n_fields, &record, line, line + length))
+      {
+      fprintf (stderr, "Line %ld: Not a JSON object\n", line_number);
+      fwrite (line, 1, length, stdout);
+      status = 1;
+      continue;
+      }
+
+    record.n_edits = 0;
+    for (i = 0; i < n_fields; i++)
+      {
+      JsonField *field = &fields[i];
+      const JsonMembers *m = &record.members[i];
+      double result;
+      const char *canonical;
+      int field_status = json_convert_field (field, m, line_number,
+        &result, &canonical);
+      if (field_status > 0)
+        {
+        status = 1;
+        if (options->stats)
+          options->stats->converter.results[converter_bad_number]++;
+        }
+      if (field_status != 0) continue;
+
+      // JSON has no infinities or NaNs
+      if (isfinite (result))
+        units_format_number (record.numbers[i], MAX_NUMBER_STRING, result,
+          options->number_format);
+      else
+        strcpy (record.numbers[i], "null");
+      json_add_edit (&record, &m->out, field->out, record.numbers[i],
+        FALSE);
+      json_add_edit (&record, &m->out_units, field->out_units,
+        canonical, TRUE);
+      if (options->stats) options->stats->converter.results[converter_ok]++;
+      }
+    json_write_record (&record, line, length, stdout);
+    }
+
+  if (ferror (in))
+    {
+    fprintf (stderr, "Error reading input: %s\n", strerror (errno));
+    status = 1;
+    }
+
+  if (options->stats) options->stats->lines += line_number;
+  free (line);
+  free (record.members);
+  free (record.edits);
+  free (record.numbers);
+  fflush (stdout);
+  return status;
+  }
+
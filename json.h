@@ -0,0 +1,51 @@
+/*============================================================================
+  json.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include "converter.h"
+#include "batch.h"
+
+// A number in a JSON record longer than this is not converted
+#define JSON_MAX_NUMBER 64
+
+// Number of conversion plans kept for each field, for values whose
+//  units differ from one record to the next
+#define JSON_CACHE_SIZE 64
+
+// A plan for the units of a field's values, and the name of the units
+//  of its results
+typedef struct _JsonPlan
+  {
+  Converter converter;
+  char *canonical;      // The name of converter.tu, once planned
+  char *canonical_from; // The "from" units that name is for
+  } JsonPlan;
+
+// A member of the JSON records to convert, as given by --field. The value
+//  is a number, or a string holding a number and perhaps its units; the
+//  units may instead be given, or taken from another member. The result,
+//  and the name of the units it is in, are written to members of their own,
+//  which replace any of the same names in the record.
+typedef struct _JsonField
+  {
+  char *name;           // Member holding the value
+  char *from;           // Units of the value, or NULL
+  char *units_name;     // Member holding the units of the value, or NULL
+  char *to;
+  char *out;            // Member for the result
+  char *out_units;      // Member for the name of the units of the result
+  JsonPlan *plans;      // JSON_CACHE_SIZE of them, by the "from" units;
+                        //  only the first is used if they are given
+  } JsonField;
+
+BOOL json_field_parse (JsonField *self, const char *spec, char **error);
+void json_field_destroy (JsonField *self);
+int json_convert_file (FILE *in, JsonField *fields, int n_fields,
+  const BatchOptions *options);
+
@@ -0,0 +1,202 @@
+/*============================================================================
+  repl.c
+
+  Interactive conversion, for uconv -i. Each line is a conversion, written
+  as it would be on the command line: "value from to", or "value+from to".
+  Parts can be left out, to be taken from the last conversion that
+  worked: a value alone is converted from and to the same units as
+  before; a value and one set of units is converted from the same units as
+  before; and units alone convert the last value to those units. Plans are
+  kept for the conversions done recently, so that going back to units
+  used earlier does not parse and reduce them again.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include "repl.h"
+
+// The state carried from one line to the next
+typedef struct _Repl
+  {
+  const BatchOptions *options;
+  char *value;        // Of the last conversion that worked, or NULL
+  char *units;
+  char *to;
+  Converter cache[REPL_CACHE_SIZE];
+  } Repl;
+
+
+/*============================================================================
+  repl_help
+============================================================================*/
+static void repl_help (FILE *out)
+  {
+  fprintf (out, "  {value} {from} {to}  Convert, as on the command line\n");
+  fprintf (out, "  {value} {to}         Convert from the same units as before\n");
+  fprintf (out, "  {value}              Convert between the same units as before\n");
+  fprintf (out, "  {to}                 Convert the last value to other units\n");
+  fprintf (out, "  quit                 Finish; so does end of input\n");
+  }
+
+
+/*============================================================================
+  repl_error
+  Report a line that can't be converted without something from an earlier
+  line, when there is no earlier line to take it from.
+============================================================================*/
+static int repl_error (Repl *self, const char *message, const char *text)
+  {
+  fprintf (stderr, "%s '%s'\n", message, text);
+  if (self->options->stats)
+    {
+    self->options->stats->lines++;
+    self->options->stats->converter.results[converter_no_units]++;
+    }
+  return 1;
+  }
+
+
+/*============================================================================
+  repl_convert_line
+  Convert one line, which is modified, filling in what it leaves out from
+  the last conversion. Returns 0 on success and 1 on failure.
+============================================================================*/
+static int repl_convert_line (Repl *self, char *line)
+  {
+  char *text = line, *to, *end, *number_end;
+
+  to = text + strlen (text);
+  while (to > text && !isspace ((int)to[-1])) to--;
+  end = to;
+  while (end > text && isspace ((int)end[-1])) end--;
+
+  if (end == text)
+    {
+    // One field, which is either a value, or the units to convert to
+    fractodn (to, strlen (to), &number_end);
+    if (number_end == to)
+      {
+      if (!self->value)
+        return repl_error (self, "No value to convert to", to);
+      text = self->value;
+      number_end = text + strlen (text);
+      }
+    else
+      {
+      if (!self->to)
+        return repl_error (self, "No units to convert to for input value",
+          to);
+      text = to;
+      to = self->to;
+      }
+    }
+  else
+    {
+    *end = 0;
+    fractodn (text, end - text, &number_end);
+    }
+
+  // If there is no number at all, the converter explains the problem
+  if (number_end == text)
+    return batch_convert (&self->cache[0], text, NULL, to, self->options,
+      stdout, stderr);
+
+  const char *units = number_end;
+  while (isspace ((int)*units)) units++;
+  if (*units == 0)
+    {
+    if (self->units)
+      units = self->units;
+    else
+      return repl_error (self, "No units specified for input value", text);
+    }
+
+  char *number = strndup (text, number_end - text);
+  Converter *converter = &self->cache[converter_hash (units, to)
+    % REPL_CACHE_SIZE];
+  int status = batch_convert (converter, number, units, to, self->options,
+    stdout, stderr);
+  if (status == 0)
+    {
+    // Copy the units first, as they may be the ones being replaced
+    char *new_units = strdup (units), *new_to = strdup (to);
+    free (self->value);
+    free (self->units);
+    free (self->to);
+    self->value = number;
+    self->units = new_units;
+    self->to = new_to;
+    }
+  else
+    free (number);
+  return status;
+  }
+
+
+/*============================================================================
+  repl_run
+  Convert the lines read from "in", until the end of the input or "quit".
+  A prompt is shown if the input and output are both terminals. Each
+  result is written out as soon as it is ready, so that a program at the
+  other end of a pipe gets its reply without waiting for more input.
+  Returns 1 if the input could not be read; a line that can't be
+  converted is reported, but is not the end of the session.
+============================================================================*/
+int repl_run (FILE *in, const BatchOptions *options)
+  {
+  Repl self;
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t length;
+  int i;
+  BOOL prompt = isatty (fileno (in)) && isatty (fileno (stdout));
+
+  self.options = options;
+  self.value = self.units = self.to = NULL;
+  for (i = 0; i < REPL_CACHE_SIZE; i++)
+    batch_converter_init (&self.cache[i], options);
+
+  if (prompt)
+    printf ("Type 'help' for the forms of conversion\n");
+  for (;;)
+    {
+    if (prompt)
+      {
+      fputs ("> ", stdout);
+      fflush (stdout);
+      }
+    if ((length = getline (&line, &size, in)) < 0) break;
+
+    char *s = line;
+    while (length > 0 && isspace ((int)s[length - 1])) length--;
+    s[length] = 0;
+    while (isspace ((int)*s)) s++;
+
+    if (*s == 0) continue;
+    if (strcmp (s, "quit") == 0 || strcmp (s, "exit") == 0) break;
+    if (strcmp (s, "help") == 0)
+      repl_help (stdout);
+    else
+      repl_convert_line (&self, s);
+    fflush (stdout);
+    }
+  if (prompt && length < 0) putchar ('\n');
+
+  int status = ferror (in) ? 1 : 0;
+  if (status) perror (NULL);
+
+  free (line);
+  free (self.value);
+  free (self.units);
+  free (self.to);
+  for (i = 0; i < REPL_CACHE_SIZE; i++)
+    converter_destroy (&self.cache[i]);
+  return status;
+  }
+
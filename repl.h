@@ -0,0 +1,16 @@
+/*============================================================================
+  repl.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include "batch.h"
+
+// Number of conversion plans kept between lines
+#define REPL_CACHE_SIZE 64
+
+int repl_run (FILE *in, const BatchOptions *options);
+
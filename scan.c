@@ -0,0 +1,455 @@
+/*============================================================================
+  scan.c
+
+  Conversion of the quantities in free text, for uconv --scan. A quantity
+  is a number followed by units, with or without a space between them:
+  "12.3MiB", "450 ms", "3 ft". Each one whose units have the dimensions
+  of one of the sets of units given is converted to them, and rewritten
+  in place; every other byte of the text is copied as it is.
+
+  Most text has few numbers, so the scan moves from one digit to the next,
+  and looks at the text around a digit only when it finds one. Digits are
+  found with vector compares where the CPU has them, so text without
+  numbers is passed over about as fast as it can be read. Conversions are
+  remembered by the units they are from, so a set of units, or a word
+  that is not units, is parsed only once however often it appears.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "scan.h"
+
+// Find digits with vector compares, chosen at run time as in units.c
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+#define SCAN_IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define SCAN_IS_ALPHA(c) (((c) | 0x20) >= 'a' && ((c) | 0x20) <= 'z')
+#define SCAN_IS_WORD(c) (SCAN_IS_DIGIT (c) || SCAN_IS_ALPHA (c) || (c) == '_')
+#define SCAN_IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+// A quantity found in the text
+typedef struct _ScanQuantity
+  {
+  const char *start;        // Of the number
+  const char *number_end;
+  const char *units;        // After the space, if any, that follows it
+  const char *units_end;
+  double value;
+  } ScanQuantity;
+
+
+/*============================================================================
+  scan_find_digit_scalar
+  Return the first ASCII digit from p up to end, or end if there is none.
+============================================================================*/
+static const char *scan_find_digit_scalar (const char *p, const char *end)
+  {
+  while (p < end && !SCAN_IS_DIGIT (*p)) p++;
+  return p;
+  }
+
+
+#ifdef SCAN_X86_DISPATCH
+
+/*============================================================================
+  scan_find_digit_sse2
+  The compares are signed, so bytes from 0x80 up, which are negative, are
+  never taken for digits.
+============================================================================*/
+__attribute__((target("sse2")))
+static const char *scan_find_digit_sse2 (const char *p, const char *end)
+  {
+  __m128i below = _mm_set1_epi8 ('0' - 1);
+  __m128i above = _mm_set1_epi8 ('9' + 1);
+  for (; p + 16 <= end; p += 16)
+    {
+    __m128i v = _mm_loadu_si128 ((const __m128i *)p);
+    unsigned mask = _mm_movemask_epi8 (_mm_and_si128 (
+      _mm_cmpgt_epi8 (v, below), _mm_cmpgt_epi8 (above, v)));
+    if (mask) return p + __builtin_ctz (mask);
+    }
+  return scan_find_digit_scalar (p, end);
+  }
+
+
+/*============================================================================
+  scan_find_digit_avx2
+============================================================================*/
+__attribute__((target("avx2")))
+static const char *scan_find_digit_avx2 (const char *p, const char *end)
+  {
+  __m256i below = _mm256_set1_epi8 ('0' - 1);
+  __m256i above = _mm256_set1_epi8 ('9' + 1);
+  for (; p + 32 <= end; p += 32)
+    {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *)p);
+    unsigned mask = _mm256_movemask_epi8 (_mm256_and_si256 (
+      _mm256_cmpgt_epi8 (v, below), _mm256_cmpgt_epi8 (above, v)));
+    if (mask) return p + __builtin_ctz (mask);
+    }
+  return scan_find_digit_scalar (p, end);
+  }
+
+#endif // SCAN_X86_DISPATCH
+
+
+typedef const char *(*ScanDigitKernel) (const char *p, const char *end);
+
+static ScanDigitKernel scan_find_digit = scan_find_digit_scalar;
+
+/*============================================================================
+  scan_select_kernel
+  Choose the widest vector implementation the CPU supports. Digits are
+  found faster than text can be read with 32 bytes at a time, so there is
+  nothing to gain from AVX-512.
+============================================================================*/
+static void scan_select_kernel (void)
+  {
+#ifdef SCAN_X86_DISPATCH
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    scan_find_digit = scan_find_digit_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    scan_find_digit = scan_find_digit_sse2;
+#endif
+  }
+
+
+/*============================================================================
+  scan_init
+  Prepare to convert quantities to the given units. Each set of units is
+  parsed now, so that a mistake in one is reported before any text is
+  read. Where two have the same dimensions, quantities are converted to
+  the first. Returns FALSE, and sets *error, if any can't be parsed.
+============================================================================*/
+BOOL scan_init (Scanner *self, int n_targets, char **targets,
+    const BatchOptions *options, char **error)
+  {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  char message[MAX_ERROR_STRING];
+  Units units;
+  int i;
+
+  pthread_once (&once, scan_select_kernel);
+  for (i = 0; i < n_targets; i++)
+    {
+    if (!units_parse_into (&units, targets[i], message, sizeof (message)))
+      {
+      *error = strdup (message);
+      return FALSE;
+      }
+    }
+
+  self->options = options;
+  self->n_targets = n_targets;
+  self->targets = targets;
+  self->target_lengths = malloc (n_targets * sizeof (size_t));
+  for (i = 0; i < n_targets; i++)
+    self->target_lengths[i] = strlen (targets[i]);
+  self->cache = calloc (SCAN_CACHE_SIZE, sizeof (ScanUnits));
+  self->out = malloc (SCAN_OUTPUT_SIZE);
+  self->out_length = 0;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  scan_destroy
+============================================================================*/
+void scan_destroy (Scanner *self)
+  {
+  int i;
+  for (i = 0; i < SCAN_CACHE_SIZE; i++)
+    {
+    free (self->cache[i].text);
+    converter_destroy (&self->cache[i].converter);
+    }
+  free (self->cache);
+  free (self->target_lengths);
+  free (self->out);
+  self->cache = NULL;
+  }
+
+
+/*============================================================================
+  scan_lookup_units
+  Find the conversion for the units at "text", working it out if it is not
+  already known. The result has target -1 if the text is not units, or
+  has none of the dimensions asked for.
+============================================================================*/
+static const ScanUnits *scan_lookup_units (Scanner *self, const char *text,
+    size_t length)
+  {
+  char units[MAX_UNIT_STRING];
+  double value, result;
+  int i;
+
+  memcpy (units, text, length);
+  units[length] = 0;
+  ScanUnits *slot = &self->cache[converter_hash (units, "")
+    % SCAN_CACHE_SIZE];
+  if (slot->text && strcmp (slot->text, units) == 0) return slot;
+
+  free (slot->text);
+  converter_destroy (&slot->converter);
+  converter_init (&slot->converter, self->options->default_to_iec);
+  slot->text = strdup (units);
+  slot->target = -1;
+
+  for (i = 0; i < self->n_targets; i++)
+    {
+    char *error = NULL;
+    ConverterStatus status = converter_convert (&slot->converter, "1",
+      units, self->targets[i], &value, &result, &error);
+    free (error);
+    if (status == converter_ok)
+      {
+      slot->target = i;
+      break;
+      }
+    // Units that don't parse won't parse for the next target either
+    if (status != converter_incompatible_units) break;
+    }
+  return slot;
+  }
+
+
+/*============================================================================
+  scan_units_end
+  Return the end of the units that start at p, which are letters and
+  digits, the '.', '/' and '^' that join and raise them, and the micro
+  sign or Greek mu. Punctuation at the end, such as a full stop, is left
+  out.
+============================================================================*/
+static const char *scan_units_end (const char *p, const char *end)
+  {
+  const char *q = p;
+  while (q < end)
+    {
+    unsigned char c = *q;
+    if (SCAN_IS_WORD (c) || c == '.' || c == '/' || c == '^' ||
+        (c == '-' && q > p && q[-1] == '^'))
+      q++;
+    else if (q + 1 < end && ((c == 0xc2 && (unsigned char)q[1] == 0xb5) ||
+        (c == 0xce && (unsigned char)q[1] == 0xbc)))
+      q += 2;
+    else
+      break;
+    }
+  while (q > p && (q[-1] == '.' || q[-1] == '/' || q[-1] == '^' ||
+      q[-1] == '-'))
+    q--;
+  return q;
+  }
+
+
+/*============================================================================
+  scan_quantity
+  Read the quantity, if there is one, around the digit at p. The number
+  must start a word, and may begin with a sign or a decimal point. Its
+  units must follow it on the same line, after at most one space or tab,
+  and must end a word. Returns FALSE if there is no quantity here.
+============================================================================*/
+static BOOL scan_quantity (const char *text, const char *p,
+    const char *end, ScanQuantity *quantity)
+  {
+  const char *s = p, *number_end, *u;
+  char *e;
+
+  if (s > text && s[-1] == '.') s--;
+  if (s > text && (s[-1] == '-' || s[-1] == '+')) s--;
+  if (s > text)
+    {
+    // Not a version number, an identifier, or part of "1,234"
+    unsigned char c = s[-1];
+    if (SCAN_IS_WORD (c) || c == '.' || c >= 0x80 ||
+        (c == ',' && s - 1 > text && SCAN_IS_DIGIT (s[-2])))
+      return FALSE;
+    }
+
+  // Most numbers in text are not quantities, but parts of dates, times or
+  //  addresses; these are told by what follows the digits, before the
+  //  number is read properly
+  const char *q = p;
+  while (q < end && (SCAN_IS_DIGIT (*q) || *q == '.')) q++;
+  if (q == end || !(*q == ' ' || *q == '\t' || *q == '/' ||
+      SCAN_IS_ALPHA (*q) || (unsigned char)*q >= 0x80))
+    return FALSE;
+
+  errno = 0;
+  quantity->value = fractodn (s, end - s < SCAN_MAX_NUMBER ?
+    (size_t)(end - s) : SCAN_MAX_NUMBER, &e);
+  if (errno != 0 || e == s) return FALSE;
+  number_end = e;
+  while (number_end > s && SCAN_IS_SPACE (number_end[-1])) number_end--;
+  // One line, and not hexadecimal, which fractod would read
+  if (memchr (s, '\n', number_end - s) || memchr (s, 'x', number_end - s) ||
+      memchr (s, 'X', number_end - s))
+    return FALSE;
+
+  u = number_end;
+  if (u < end && (*u == ' ' || *u == '\t')) u++;
+  if (u == end || !(SCAN_IS_ALPHA (*u) || (unsigned char)*u >= 0x80))
+    return FALSE;
+  quantity->units_end = scan_units_end (u, end);
+  if (quantity->units_end == u || quantity->units_end - u >= MAX_UNIT_STRING)
+    return FALSE;
+  if (quantity->units_end < end &&
+      (unsigned char)*quantity->units_end >= 0x80)
+    return FALSE;
+
+  quantity->start = s;
+  quantity->number_end = number_end;
+  quantity->units = u;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  scan_put
+  Add text to the output, which is gathered in the scanner's buffer, and
+  written out when it fills, rather than passed to stdio a piece at a
+  time. Runs of text of more than a few kilobytes are written as they
+  are, without being copied.
+============================================================================*/
+static inline void scan_put (Scanner *self, const char *s, size_t length,
+    FILE *out)
+  {
+  if (self->out_length + length > SCAN_OUTPUT_SIZE || 
+      length >= SCAN_OUTPUT_SIZE / 16)
+    {
+    fwrite (self->out, 1, self->out_length, out);
+    self->out_length = 0;
+    }
+  if (length >= SCAN_OUTPUT_SIZE / 16)
+    fwrite (s, 1, length, out);
+  else
+    {
+    memcpy (self->out + self->out_length, s, length);
+    self->out_length += length;
+    }
+  }
+
+
+/*============================================================================
+  scan_text
+  Write the "length" bytes at "text" to "out", with the quantities in them
+  converted. The text should start at the start of a line, and end at the
+  end of one.
+============================================================================*/
+void scan_text (Scanner *self, const char *text, size_t length, FILE *out)
+  {
+  const char *p = text, *end = text + length, *copied = text;
+  char number[MAX_NUMBER_STRING];
+  ScanQuantity quantity;
+
+  while ((p = scan_find_digit (p, end)) < end)
+    {
+    const ScanUnits *units = NULL;
+    if (scan_quantity (text, p, end, &quantity))
+      units = scan_lookup_units (self, quantity.units,
+        quantity.units_end - quantity.units);
+    if (!units || units->target < 0)
+      {
+      // Nothing else in the same word can start a quantity
+      while (p < end && SCAN_IS_WORD (*p)) p++;
+      continue;
+      }
+
+    double result = units_plan_apply (&units->converter.plan,
+      quantity.value);
+    units_format_number (number, sizeof (number), result,
+      self->options->number_format);
+    scan_put (self, copied, quantity.start - copied, out);
+    scan_put (self, number, strlen (number), out);
+    scan_put (self, quantity.number_end, quantity.units - 
+      quantity.number_end, out);
+    scan_put (self, self->targets[units->target], 
+      self->target_lengths[units->target], out);
+    copied = p = quantity.units_end;
+
+    if (self->options->stats)
+      {
+      self->options->stats->lines++;
+      self->options->stats->converter.results[converter_ok]++;
+      }
+    }
+  scan_put (self, copied, end - copied, out);
+  fwrite (self->out, 1, self->out_length, out);
+  self->out_length = 0;
+  }
+
+
+/*============================================================================
+  scan_convert_file
+  Convert the quantities in the text read from "in", writing the text to
+  stdout. Input is read as it arrives, and converted up to the end of the
+  last whole line, so output is flushed whenever the input has to be
+  waited for; text from a pipe that is still being written to, such as a
+  log being followed, is passed on without delay.
+============================================================================*/
+int scan_convert_file (FILE *in, const char *name, int n_targets,
+    char **targets, const BatchOptions *options)
+  {
+  static char out_buffer[STREAM_BUFFER_SIZE];
+  Scanner self;
+  char *error = NULL;
+  int status = 0, fd = fileno (in);
+  size_t size = SCAN_BUFFER_SIZE, length = 0;
+
+  if (!scan_init (&self, n_targets, targets, options, &error))
+    {
+    fprintf (stderr, "Error: %s\n", error);
+    free (error);
+    return 1;
+    }
+  setvbuf (stdout, out_buffer, _IOFBF, sizeof (out_buffer));
+
+  char *buffer = malloc (size);
+  for (;;)
+    {
+    if (length == size)
+      buffer = realloc (buffer, size *= 2);
+    ssize_t n = read (fd, buffer + length, size - length);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0)
+      {
+      fprintf (stderr, "%s: %s\n", name, strerror (errno));
+      status = 1;
+      }
+    if (n <= 0) break;
+
+    // Convert up to the end of the last whole line, and keep back the
+    //  rest, which has no newline in it, to be finished by the next read
+    size_t kept = length, whole;
+    length += n;
+    whole = length;
+    while (whole > kept && buffer[whole - 1] != '\n') whole--;
+    if (whole == kept) whole = 0;
+    scan_text (&self, buffer, whole, stdout);
+    length -= whole;
+    memmove (buffer, buffer + whole, length);
+    if ((size_t)n < size - kept) fflush (stdout);
+    }
+  scan_text (&self, buffer, length, stdout);
+
+  if (fflush (stdout) != 0)
+    {
+    fprintf (stderr, "Error writing output: %s\n", strerror (errno));
+    status = 1;
+    }
+  free (buffer);
+  scan_destroy (&self);
+  return status;
+  }
+
@@ -0,0 +1,55 @@
+/*============================================================================
+  scan.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include "converter.h"
+#include "batch.h"
+
+// Input is read up to this much at a time; a longer line makes the buffer
+//  grow to hold it
+#define SCAN_BUFFER_SIZE (1024 * 1024)
+
+// Output is gathered into blocks of this size
+#define SCAN_OUTPUT_SIZE (64 * 1024)
+
+// Number of sets of units whose conversions are remembered
+#define SCAN_CACHE_SIZE 256
+
+// A number longer than this is not taken as the value of a quantity
+#define SCAN_MAX_NUMBER 128
+
+// The units found after a number, and the units, if any, they are
+//  converted to
+typedef struct _ScanUnits
+  {
+  char *text;           // As they appeared, or NULL for an empty slot
+  int target;           // Index into the units converted to, or -1
+  Converter converter;  // Planned from text to the target units
+  } ScanUnits;
+
+// The units to convert quantities to, at most one set for each dimension,
+//  and the conversions worked out so far
+typedef struct _Scanner
+  {
+  const BatchOptions *options;
+  int n_targets;
+  char **targets;
+  size_t *target_lengths;
+  ScanUnits *cache;     // SCAN_CACHE_SIZE slots
+  char *out;            // Output not yet written, SCAN_OUTPUT_SIZE bytes
+  size_t out_length;
+  } Scanner;
+
+BOOL scan_init (Scanner *self, int n_targets, char **targets,
+  const BatchOptions *options, char **error);
+void scan_destroy (Scanner *self);
+void scan_text (Scanner *self, const char *text, size_t length, FILE *out);
+int scan_convert_file (FILE *in, const char *name, int n_targets,
+  char **targets, const BatchOptions *options);
+
@@ -0,0 +1,778 @@
+/*============================================================================
+  serve.c
+
+  A server that converts values for clients on a Unix domain socket, so
+  that a script that needs many conversions does not start a process for
+  each of them; and the client that talks to it.
+
+  Each line a client sends is a request, "value from to" or "value+from
+  to", and gets one line in reply: the result, as uconv would print it,
+  or "Error: " and a message. Blank lines get no reply. One thread waits
+  for input with epoll, and hands the complete lines from a connection to
+  a pool of workers, one batch at a time, so the replies come back in
+  order. Each worker keeps the plans of the conversions it has done
+  recently, so that units are parsed and reduced once, not on every
+  request.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+// For accept4
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include "serve.h"
+
+#define SERVE_MAX_EVENTS 64
+
+// A client connection. While a worker has its job, the worker owns the
+//  job and the reply; everything else belongs to the main thread.
+typedef struct _ServeConnection
+  {
+  int fd;               // -1 once closed
+  unsigned events;      // Registered with epoll, or 0 if not registered
+  char *in;             // Read from the client, not yet converted
+  size_t in_length;
+  char *job;            // Complete lines, for a worker to convert
+  size_t job_length;
+  char *out;            // The reply to the last job
+  size_t out_length;
+  size_t out_sent;
+  BOOL busy;            // A worker has the job
+  BOOL eof;             // The client has finished sending, or nothing
+                        //  more is to be read from it
+  BOOL too_long;        // It sent a request that does not fit in "in"
+  BOOL failed;          // The connection can't be used any more
+  struct _ServeConnection *next_job;  // In the job, done or closed list
+  struct _ServeConnection *prev, *next;
+  } ServeConnection;
+
+typedef struct _Server Server;
+
+// A worker thread, and its cache of plans. A request is converted by the
+//  Converter in the slot given by the hash of its units, which re-plans
+//  only if the units differ from those of the slot's last conversion.
+typedef struct _ServeWorker
+  {
+  Server *server;
+  pthread_t thread;
+  BatchOptions options;
+  BatchStats stats;
+  Converter cache[SERVE_CACHE_SIZE];
+  } ServeWorker;
+
+struct _Server
+  {
+  const BatchOptions *options;
+  int epoll_fd;
+  int listen_fd;
+  int wake_fd;          // An eventfd, written when a job is done
+  int signal_fd;
+  ServeConnection *connections;
+  ServeConnection *jobs;      // Waiting for a worker, oldest first
+  ServeConnection *last_job;
+  ServeConnection *done;      // Converted, with a reply to send
+  ServeConnection *closed;    // To be freed after the current events
+  BOOL finished;
+  pthread_mutex_t lock;
+  pthread_cond_t job_ready;
+  };
+
+// Markers for the epoll events that are not from a connection
+static int listen_marker, wake_marker, signal_marker;
+
+
+/*============================================================================
+  serve_print_error
+  Print an error message as one line of reply.
+============================================================================*/
+static void serve_print_error (const char *error, FILE *out)
+  {
+  fputs ("Error: ", out);
+  for (; *error; error++)
+    putc (*error == '\n' ? ' ' : *error, out);
+  putc ('\n', out);
+  }
+
+
+/*============================================================================
+  serve_convert_request
+  Convert one request line, which is modified, and print the reply. The
+  last field of the line is the units to convert to; the rest is the 
+  value and its units, read as uconv -f reads a line.
+============================================================================*/
+static void serve_convert_request (ServeWorker *self, char *line, FILE *out)
+  {
+  char *from = line, *to, *end;
+  size_t length;
+
+  if (self->options.stats) self->stats.lines++;
+
+  while (isspace ((int)*from)) from++;
+  end = from + strlen (from);
+  while (end > from && isspace ((int)end[-1])) end--;
+  if (end == from) return;
+  *end = 0;
+
+  to = end;
+  while (to > from && !isspace ((int)to[-1])) to--;
+  end = to;
+  while (end > from && isspace ((int)end[-1])) end--;
+  if (end == from)
+    {
+    serve_print_error ("Expected a value, its units, and the units to "
+      "convert to", out);
+    return;
+    }
+  *end = 0;
+  length = end - from;
+
+  // A request stands alone, so a value must have units
+  char *units;
+  fractodn (from, length, &units);
+  if (units > from && units == end)
+    {
+    fprintf (out, "Error: No units specified for input value '%s'\n", from);
+    if (self->options.stats)
+      self->stats.converter.results[converter_no_units]++;
+    return;
+    }
+
+  Converter *converter = &self->cache[converter_hash (units, to) 
+    % SERVE_CACHE_SIZE];
+  double value, res;
+  char *error = NULL;
+  if (converter_convert_text (converter, from, length, to, &value, &res, 
+      &error) == converter_ok)
+    batch_print (converter, value, res, &self->options, out);
+  else
+    {
+    serve_print_error (error, out);
+    free (error);
+    }
+  }
+
+
+/*============================================================================
+  serve_convert_job
+  Convert the lines of a connection's job, writing the replies to its
+  output.
+============================================================================*/
+static void serve_convert_job (ServeWorker *self, ServeConnection *conn)
+  {
+  char *p = conn->job, *end = conn->job + conn->job_length;
+  FILE *out = open_memstream (&conn->out, &conn->out_length);
+
+  while (p < end)
+    {
+    char *eol = memchr (p, '\n', end - p);
+    *eol = 0;
+    serve_convert_request (self, p, out);
+    p = eol + 1;
+    }
+
+  fclose (out);
+  }
+
+
+/*============================================================================
+  serve_worker
+============================================================================*/
+static void *serve_worker (void *arg)
+  {
+  ServeWorker *self = arg;
+  Server *server = self->server;
+  const uint64_t one = 1;
+
+  pthread_mutex_lock (&server->lock);
+  for (;;)
+    {
+    while (!server->jobs && !server->finished)
+      pthread_cond_wait (&server->job_ready, &server->lock);
+    if (server->finished) break;
+
+    ServeConnection *conn = server->jobs;
+    server->jobs = conn->next_job;
+    if (!server->jobs) server->last_job = NULL;
+    pthread_mutex_unlock (&server->lock);
+    serve_convert_job (self, conn);
+    pthread_mutex_lock (&server->lock);
+    conn->next_job = server->done;
+    server->done = conn;
+    write (server->wake_fd, &one, sizeof (one));
+    }
+  pthread_mutex_unlock (&server->lock);
+  return NULL;
+  }
+
+
+/*============================================================================
+  serve_set_events
+  Change the events epoll reports for a connection. A connection with
+  nothing to wait for is removed, so that a hang-up is not reported over
+  and over while a worker has its job.
+============================================================================*/
+static void serve_set_events (Server *server, ServeConnection *conn,
+    unsigned events)
+  {
+  struct epoll_event ev;
+
+  if (events == conn->events) return;
+  ev.events = events;
+  ev.data.ptr = conn;
+  epoll_ctl (server->epoll_fd, !conn->events ? EPOLL_CTL_ADD :
+    events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL, conn->fd, &ev);
+  conn->events = events;
+  }
+
+
+/*============================================================================
+  serve_close
+  Close a connection. It is freed once the current events are handled,
+  since one of them might be for it.
+============================================================================*/
+static void serve_close (Server *server, ServeConnection *conn)
+  {
+  serve_set_events (server, conn, 0);
+  close (conn->fd);
+  conn->fd = -1;
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    server->connections = conn->next;
+  if (conn->next) conn->next->prev = conn->prev;
+  conn->next_job = server->closed;
+  server->closed = conn;
+  }
+
+
+/*============================================================================
+  serve_free_connection
+============================================================================*/
+static void serve_free_connection (ServeConnection *conn)
+  {
+  free (conn->in);
+  free (conn->job);
+  free (conn->out);
+  free (conn);
+  }
+
+
+/*============================================================================
+  serve_accept
+============================================================================*/
+static void serve_accept (Server *server)
+  {
+  int fd;
+
+  while ((fd = accept4 (server->listen_fd, NULL, NULL, 
+      SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
+    {
+    ServeConnection *conn = calloc (1, sizeof (ServeConnection));
+    conn->fd = fd;
+    conn->in = malloc (SERVE_BUFFER_SIZE + 1);
+    conn->job = malloc (SERVE_BUFFER_SIZE + 1);
+    conn->next = server->connections;
+    if (conn->next) conn->next->prev = conn;
+    server->connections = conn;
+    serve_set_events (server, conn, EPOLLIN);
+    }
+  }
+
+
+/*============================================================================
+  serve_read
+  Read what the client has sent. At the end of its input, a last line
+  without a newline is given one.
+============================================================================*/
+static void serve_read (ServeConnection *conn)
+  {
+  ssize_t n = read (conn->fd, conn->in + conn->in_length,
+    SERVE_BUFFER_SIZE - conn->in_length);
+
+  if (n > 0)
+    conn->in_length += n;
+  else if (n == 0)
+    {
+    conn->eof = TRUE;
+    if (conn->in_length > 0 && conn->in[conn->in_length - 1] != '\n')
+      conn->in[conn->in_length++] = '\n';
+    }
+  else if (errno != EAGAIN && errno != EINTR)
+    conn->failed = TRUE;
+  }
+
+
+/*============================================================================
+  serve_write
+  Send as much of the reply as the client will take.
+============================================================================*/
+static void serve_write (ServeConnection *conn)
+  {
+  while (conn->out_sent < conn->out_length)
+    {
+    ssize_t n = send (conn->fd, conn->out + conn->out_sent,
+      conn->out_length - conn->out_sent, MSG_NOSIGNAL);
+    if (n < 0)
+      {
+      if (errno != EAGAIN && errno != EINTR) conn->failed = TRUE;
+      return;
+      }
+    conn->out_sent += n;
+    }
+
+  free (conn->out);
+  conn->out = NULL;
+  conn->out_length = conn->out_sent = 0;
+  }
+
+
+/*============================================================================
+  serve_dispatch
+  Give the complete lines read from a connection to a worker.
+============================================================================*/
+static void serve_dispatch (Server *server, ServeConnection *conn)
+  {
+  char *p = conn->in + conn->in_length;
+  while (p > conn->in && p[-1] != '\n') p--;
+  if (p == conn->in) return;
+
+  conn->job_length = p - conn->in;
+  memcpy (conn->job, conn->in, conn->job_length);
+  conn->in_length -= conn->job_length;
+  memmove (conn->in, p, conn->in_length);
+  conn->busy = TRUE;
+  conn->next_job = NULL;
+
+  pthread_mutex_lock (&server->lock);
+  if (server->last_job)
+    server->last_job->next_job = conn;
+  else
+    server->jobs = conn;
+  server->last_job = conn;
+  pthread_cond_signal (&server->job_ready);
+  pthread_mutex_unlock (&server->lock);
+  }
+
+
+/*============================================================================
+  serve_update
+  Decide what to do next with a connection: start a job if it is idle,
+  close it if it is finished, or wait for more input or room for output.
+============================================================================*/
+static void serve_update (Server *server, ServeConnection *conn)
+  {
+  unsigned events = 0;
+
+  // A request that doesn't fit in the buffer can't be read. The client 
+  //  is told so, after the replies to the requests before it, and then
+  //  the connection is closed
+  if (!conn->eof && !conn->failed && conn->in_length == SERVE_BUFFER_SIZE
+      && !memchr (conn->in, '\n', conn->in_length))
+    {
+    conn->in_length = 0;
+    conn->eof = TRUE;
+    conn->too_long = TRUE;
+    }
+
+  if (!conn->busy && !conn->failed && conn->out_length == 0)
+    {
+    if (conn->too_long)
+      {
+      conn->out = strdup ("Error: Request too long\n");
+      conn->out_length = strlen (conn->out);
+      conn->out_sent = 0;
+      conn->too_long = FALSE;
+      }
+    else
+      serve_dispatch (server, conn);
+    }
+
+  if (!conn->busy && (conn->failed || (conn->eof && conn->in_length == 0
+      && conn->out_length == 0)))
+    {
+    serve_close (server, conn);
+    return;
+    }
+
+  if (!conn->eof && !conn->failed && conn->in_length < SERVE_BUFFER_SIZE)
+    events |= EPOLLIN;
+  if (!conn->busy && conn->out_length > 0 && !conn->failed) 
+    events |= EPOLLOUT;
+  serve_set_events (server, conn, events);
+  }
+
+
+/*============================================================================
+  serve_collect
+  Send the replies to the jobs the workers have finished.
+============================================================================*/
+static void serve_collect (Server *server)
+  {
+  uint64_t n;
+  ServeConnection *conn, *next;
+
+  read (server->wake_fd, &n, sizeof (n));
+  pthread_mutex_lock (&server->lock);
+  conn = server->done;
+  server->done = NULL;
+  pthread_mutex_unlock (&server->lock);
+
+  for (; conn; conn = next)
+    {
+    next = conn->next_job;
+    conn->busy = FALSE;
+    conn->out_sent = 0;
+    if (!conn->failed) serve_write (conn);
+    serve_update (server, conn);
+    }
+  }
+
+
+/*============================================================================
+  serve_is_stale
+  Check whether a socket at the given address was left behind by a server
+  that is no longer running.
+============================================================================*/
+static BOOL serve_is_stale (const struct sockaddr_un *addr)
+  {
+  struct stat sb;
+  if (lstat (addr->sun_path, &sb) != 0 || !S_ISSOCK (sb.st_mode))
+    return FALSE;
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  BOOL stale = fd >= 0 && connect (fd, (const struct sockaddr *)addr,
+    sizeof (*addr)) != 0 && errno == ECONNREFUSED;
+  if (fd >= 0) close (fd);
+  return stale;
+  }
+
+
+/*============================================================================
+  serve_address
+============================================================================*/
+static BOOL serve_address (struct sockaddr_un *addr, const char *path)
+  {
+  memset (addr, 0, sizeof (*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen (path) >= sizeof (addr->sun_path))
+    {
+    fprintf (stderr, "%s: Socket name is too long\n", path);
+    return FALSE;
+    }
+  strcpy (addr->sun_path, path);
+  return TRUE;
+  }
+
+
+/*============================================================================
+  serve_listen
+  Create the socket, replacing one left behind by a server that has
+  stopped. Returns -1 on error, after reporting it.
+============================================================================*/
+static int serve_listen (const char *path)
+  {
+  struct sockaddr_un addr;
+  if (!serve_address (&addr, path)) return -1;
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    {
+    fprintf (stderr, "Can't create socket: %s\n", strerror (errno));
+    return -1;
+    }
+
+  int bound = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+  if (bound != 0 && errno == EADDRINUSE && serve_is_stale (&addr))
+    {
+    unlink (path);
+    bound = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+    }
+  if (bound != 0 || listen (fd, SOMAXCONN) != 0)
+    {
+    fprintf (stderr, "%s: %s\n", path, strerror (errno));
+    close (fd);
+    return -1;
+    }
+  return fd;
+  }
+
+
+/*============================================================================
+  serve_watch
+============================================================================*/
+static void serve_watch (Server *server, int fd, void *marker)
+  {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = marker;
+  epoll_ctl (server->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+
+/*============================================================================
+  serve_run
+  Serve conversions on a socket at the given path, with options->threads
+  workers, until interrupted or terminated. The socket is removed when
+  the server stops.
+============================================================================*/
+int serve_run (const char *path, const BatchOptions *options)
+  {
+  Server server;
+  ServeWorker *workers;
+  struct epoll_event events[SERVE_MAX_EVENTS];
+  sigset_t signals;
+  int i, j, n_workers = 0, status = 0, err = 0;
+
+  memset (&server, 0, sizeof (server));
+  server.options = options;
+  server.listen_fd = serve_listen (path);
+  if (server.listen_fd < 0) return 1;
+
+  // Signals are blocked before the workers start, so that only the
+  //  main thread sees them, through signal_fd
+  sigemptyset (&signals);
+  sigaddset (&signals, SIGINT);
+  sigaddset (&signals, SIGTERM);
+  pthread_sigmask (SIG_BLOCK, &signals, NULL);
+  server.signal_fd = signalfd (-1, &signals, SFD_CLOEXEC);
+  server.wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  server.epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  serve_watch (&server, server.listen_fd, &listen_marker);
+  serve_watch (&server, server.wake_fd, &wake_marker);
+  serve_watch (&server, server.signal_fd, &signal_marker);
+  pthread_mutex_init (&server.lock, NULL);
+  pthread_cond_init (&server.job_ready, NULL);
+
+  workers = calloc (options->threads, sizeof (ServeWorker));
+  for (i = 0; i < options->threads; i++)
+    {
+    ServeWorker *worker = &workers[n_workers];
+    worker->server = &server;
+    worker->options = *options;
+    if (options->stats) worker->options.stats = &worker->stats;
+    // A reply has no room to say that a name was corrected, so none is
+    worker->options.autocorrect = FALSE;
+    for (j = 0; j < SERVE_CACHE_SIZE; j++)
+      batch_converter_init (&worker->cache[j], &worker->options);
+    // pthread_create returns its error, rather than setting errno
+    err = pthread_create (&worker->thread, NULL, serve_worker, worker);
+    if (err != 0) break;
+    n_workers++;
+    }
+
+  if (n_workers == 0)
+    {
+    fprintf (stderr, "Can't start worker threads: %s\n", strerror (err));
+    status = 1;
+    }
+
+  while (n_workers > 0)
+    {
+    int n = epoll_wait (server.epoll_fd, events, SERVE_MAX_EVENTS, -1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0)
+      {
+      fprintf (stderr, "Error waiting for clients: %s\n", strerror (errno));
+      status = 1;
+      break;
+      }
+
+    BOOL stop = FALSE;
+    for (i = 0; i < n; i++)
+      {
+      void *ptr = events[i].data.ptr;
+      if (ptr == &listen_marker)
+        serve_accept (&server);
+      else if (ptr == &wake_marker)
+        serve_collect (&server);
+      else if (ptr == &signal_marker)
+        stop = TRUE;
+      else
+        {
+        ServeConnection *conn = ptr;
+        if (conn->fd < 0) continue;
+        if (!conn->eof && 
+            (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+          serve_read (conn);
+        if (events[i].events & EPOLLOUT)
+          serve_write (conn);
+        serve_update (&server, conn);
+        }
+      }
+
+    while (server.closed)
+      {
+      ServeConnection *conn = server.closed;
+      server.closed = conn->next_job;
+      serve_free_connection (conn);
+      }
+    if (stop) break;
+    }
+
+  pthread_mutex_lock (&server.lock);
+  server.finished = TRUE;
+  pthread_cond_broadcast (&server.job_ready);
+  pthread_mutex_unlock (&server.lock);
+  for (i = 0; i < n_workers; i++)
+    pthread_join (workers[i].thread, NULL);
+
+  while (server.connections)
+    {
+    ServeConnection *conn = server.connections;
+    server.connections = conn->next;
+    close (conn->fd);
+    serve_free_connection (conn);
+    }
+  for (i = 0; i < options->threads; i++)
+    {
+    if (options->stats) batch_stats_add (options->stats, &workers[i].stats);
+    for (j = 0; j < SERVE_CACHE_SIZE; j++)
+      converter_destroy (&workers[i].cache[j]);
+    }
+  free (workers);
+
+  close (server.epoll_fd);
+  close (server.wake_fd);
+  close (server.signal_fd);
+  close (server.listen_fd);
+  unlink (path);
+  pthread_mutex_destroy (&server.lock);
+  pthread_cond_destroy (&server.job_ready);
+  return status;
+  }
+
+
+/*============================================================================
+  serve_client
+  Send requests to the server at "path", and print its replies. The
+  request is made of the arguments, if there are any; otherwise, each
+  line of stdin is a request. Returns 1 if any reply is an error.
+============================================================================*/
+int serve_client (const char *path, int argc, char **argv)
+  {
+  static const char error_prefix[] = "Error:";
+  static char input[SERVE_BUFFER_SIZE], reply[SERVE_BUFFER_SIZE];
+  struct sockaddr_un addr;
+  char *request = NULL;
+  const char *pending = NULL;
+  size_t pending_length = 0, pending_sent = 0;
+  BOOL sending = TRUE;
+  int i, matched = 0, status = 0;
+
+  if (!serve_address (&addr, path)) return 1;
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+    {
+    fprintf (stderr, "%s: %s\n", path, strerror (errno));
+    if (fd >= 0) close (fd);
+    return 1;
+    }
+
+  if (argc > 0)
+    {
+    FILE *f = open_memstream (&request, &pending_length);
+    for (i = 0; i < argc; i++)
+      fprintf (f, "%s%s", argv[i], i < argc - 1 ? " " : "\n");
+    fclose (f);
+    pending = request;
+    }
+
+  // Requests are sent as the replies are read, so that neither side can
+  //  be held up by a full socket
+  for (;;)
+    {
+    struct pollfd fds[2];
+    int n_fds = 1;
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    if (pending_sent < pending_length)
+      fds[0].events |= POLLOUT;
+    else if (sending && argc > 0)
+      {
+      shutdown (fd, SHUT_WR);
+      sending = FALSE;
+      }
+    else if (sending)
+      {
+      fds[1].fd = 0;
+      fds[1].events = POLLIN;
+      n_fds = 2;
+      }
+
+    if (poll (fds, n_fds, -1) < 0)
+      {
+      if (errno == EINTR) continue;
+      break;
+      }
+
+    if (n_fds == 2 && fds[1].revents)
+      {
+      ssize_t n = read (0, input, sizeof (input));
+      if (n <= 0)
+        {
+        shutdown (fd, SHUT_WR);
+        sending = FALSE;
+        }
+      else
+        {
+        pending = input;
+        pending_length = n;
+        pending_sent = 0;
+        }
+      }
+
+    if (fds[0].revents & POLLOUT)
+      {
+      ssize_t n = send (fd, pending + pending_sent,
+        pending_length - pending_sent, MSG_NOSIGNAL);
+      if (n < 0) break;
+      pending_sent += n;
+      }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+      ssize_t n = read (fd, reply, sizeof (reply));
+      if (n <= 0) break;
+      fwrite (reply, 1, n, stdout);
+      for (i = 0; i < n; i++)
+        {
+        if (reply[i] == '\n')
+          matched = 0;
+        else if (matched >= 0 && matched < (int)sizeof (error_prefix) - 1)
+          {
+          matched = reply[i] == error_prefix[matched] ? matched + 1 : -1;
+          if (matched == (int)sizeof (error_prefix) - 1) status = 1;
+          }
+        }
+      }
+    }
+
+  if (sending)
+    {
+    fprintf (stderr, "%s: Connection lost\n", path);
+    status = 1;
+    }
+  free (request);
+  close (fd);
+  fflush (stdout);
+  return status;
+  }
+
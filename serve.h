@@ -0,0 +1,21 @@
+/*============================================================================
+  serve.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include "batch.h"
+
+// Requests are read from a client up to this much at a time. A request
+//  line longer than this closes the connection
+#define SERVE_BUFFER_SIZE (64 * 1024)
+
+// Number of conversion plans each worker keeps
+#define SERVE_CACHE_SIZE 64
+
+int serve_run (const char *path, const BatchOptions *options);
+int serve_client (const char *path, int argc, char **argv);
+
@@ -0,0 +1,154 @@
+/*============================================================================
+  stats.c
+
+  The summary printed by --stats: what a run read and converted, where
+  the time went, and how much memory it used.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+static struct timespec start_time;
+
+/*============================================================================
+  Allocation counting
+  With glibc, malloc and friends can be replaced by the program, and the
+  library's own functions (strdup, getline and stdio, for example) then
+  use the replacements. Worker threads allocate too, so the count is
+  updated atomically, but only once counting has been asked for, before
+  any threads are started; until then an allocation costs one test of a
+  flag. The benchmarks count allocations the same way. Elsewhere, and
+  in builds with AddressSanitizer, which replaces malloc itself, 
+  allocations are not counted.
+============================================================================*/
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t n, size_t size);
+extern void *__libc_realloc (void *p, size_t size);
+
+static BOOL counting = FALSE;
+static unsigned long allocations = 0;
+
+void *malloc (size_t size)
+  {
+  if (counting) __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_malloc (size);
+  }
+
+void *calloc (size_t n, size_t size)
+  {
+  if (counting) __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_calloc (n, size);
+  }
+
+void *realloc (void *p, size_t size)
+  {
+  if (counting) __atomic_fetch_add (&allocations, 1, __ATOMIC_RELAXED);
+  return __libc_realloc (p, size);
+  }
+
+void stats_count_allocations (void)
+  {
+  counting = TRUE;
+  }
+
+BOOL stats_allocations (unsigned long *n)
+  {
+  *n = __atomic_load_n (&allocations, __ATOMIC_RELAXED);
+  return TRUE;
+  }
+
+#else
+
+void stats_count_allocations (void)
+  {
+  }
+
+BOOL stats_allocations (unsigned long *n)
+  {
+  *n = 0;
+  return FALSE;
+  }
+
+#endif
+
+
+/*============================================================================
+  stats_start
+  Note the time at which the run started, and start counting allocations.
+============================================================================*/
+void stats_start (void)
+  {
+  clock_gettime (CLOCK_MONOTONIC, &start_time);
+  stats_count_allocations ();
+  }
+
+
+/*============================================================================
+  stats_print_count
+============================================================================*/
+static void stats_print_count (FILE *out, const char *name, 
+    unsigned long n)
+  {
+  fprintf (out, "  %-28s %12lu\n", name, n);
+  }
+
+
+/*============================================================================
+  stats_print_time
+============================================================================*/
+static void stats_print_time (FILE *out, const char *name, double seconds)
+  {
+  fprintf (out, "  %-28s %12.6f s\n", name, seconds);
+  }
+
+
+/*============================================================================
+  stats_print
+  Print the counts and times recorded in "stats", with the elapsed and 
+  CPU time of the run, its peak resident set size, and the number of 
+  heap allocations it made.
+============================================================================*/
+void stats_print (const BatchStats *stats, FILE *out)
+  {
+  const ConverterStats *c = &stats->converter;
+  struct timespec now;
+  struct rusage usage;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  getrusage (RUSAGE_SELF, &usage);
+
+  fprintf (out, "Statistics:\n");
+  stats_print_count (out, "Lines read", stats->lines);
+  stats_print_count (out, "Conversions", c->results[converter_ok]);
+  stats_print_count (out, "Failures: bad numbers", 
+    c->results[converter_bad_number]);
+  stats_print_count (out, "Failures: no units", 
+    c->results[converter_no_units]);
+  stats_print_count (out, "Failures: unknown units", 
+    c->results[converter_bad_units]);
+  stats_print_count (out, "Failures: dimension mismatch", 
+    c->results[converter_incompatible_units]);
+  stats_print_count (out, "Units parsed and reduced", c->plans);
+  stats_print_time (out, "Parsing numbers", c->number_time);
+  stats_print_time (out, "Parsing and looking up units", c->units_time);
+  stats_print_time (out, "Reducing units", c->plan_time);
+  stats_print_time (out, "Formatting and output", stats->format_time);
+  stats_print_time (out, "Elapsed", (now.tv_sec - start_time.tv_sec) 
+    + (now.tv_nsec - start_time.tv_nsec) / 1e9);
+  stats_print_time (out, "CPU", usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+  // ru_maxrss is in kilobytes on Linux
+  fprintf (out, "  %-28s %12ld kB\n", "Peak RSS", usage.ru_maxrss);
+  unsigned long allocated;
+  if (stats_allocations (&allocated))
+    stats_print_count (out, "Heap allocations", allocated);
+  }
+
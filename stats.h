@@ -0,0 +1,17 @@
+/*============================================================================
+  stats.h
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include <stdio.h>
+#include "batch.h"
+
+void stats_start (void);
+void stats_print (const BatchStats *stats, FILE *out);
+void stats_count_allocations (void);
+BOOL stats_allocations (unsigned long *n);
+
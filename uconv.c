@@ -11,17 +11,54 @@
 #include <ctype.h>
 #include <errno.h>
 #include "units.h" 
-
-static BOOL default_to_iec = TRUE;
-static BOOL force_decimal = FALSE;
-
-typedef enum {
-  no_prefix,
-  iec_prefix,
-  si_prefix,
-  digital_storage_prefix_enum_count,
-} DigitalStoragePrefixType;
-
+#include "converter.h" 
+#include "batch.h" 
+#include "csv.h" 
+#include "json.h" 
+#include "binary.h" 
+#include "stats.h" 
+#include "serve.h" 
+#include "repl.h" 
+#include "scan.h" 
+
+static BatchOptions options = 
+  {
+  .default_to_iec = TRUE,
+  .force_decimal = FALSE,
+  .number_format = units_format_general,
+  .threads = 1
+  };
+
+// Socket for --serve or --client
+static const char *serve_path = NULL;
+static const char *client_path = NULL;
+
+// Recorded for --stats
+static BatchStats stats;
+
+// Input for --csv and --tsv, and the columns to convert
+static const char *csv_file = NULL;
+static char csv_separator = ',';
+static BOOL csv_header = TRUE;
+static CsvColumn *csv_columns = NULL;
+static int n_csv_columns = 0;
+
+// Input for --jsonl, and the fields to convert
+static const char *json_file = NULL;
+static JsonField *json_fields = NULL;
+static int n_json_fields = 0;
+
+// Input for --binary
+static const char *binary_file = NULL;
+static BinaryType binary_type = binary_float64;
+static BOOL binary_in_place = FALSE;
+
+// Input for --scan
+static const char *scan_file = NULL;
+
+// Results gathered for --sum and the like, in place of printing them
+static int aggregate_figures = 0;
+static BatchAggregate aggregate;
 
 /*============================================================================
   show_version 
@@ -43,226 +80,233 @@ void show_usage (const char *argv0, FILE *out)
   fprintf (out, "Usage: %s [options] {number} {from_units} {to_units}\n", argv0);
   fprintf (out, "Options:\n");
   fprintf (out, "  -d                Force decimal output\n");
+  fprintf (out, "  -f {file}         Read input values from a file, one per line ('-' for stdin)\n");
   fprintf (out, "  -h                Show this message\n");
+  fprintf (out, "  -i                Convert interactively, one line at a time\n");
+  fprintf (out, "  -j {n}            Convert a file with -f using n threads\n");
   fprintf (out, "  -l                List available units\n");
   fprintf (out, "  -m                Accept multiple input values\n");
+  fprintf (out, "  -r                Print values exactly, with as many digits as needed\n");
   fprintf (out, "  -s                Use powers of 10 instead of 2 for bytes and bits\n");
   fprintf (out, "  -v                Show version\n");
+  fprintf (out, "  --autocorrect     Read a misspelt unit name as the one closest to it\n");
+  fprintf (out, "  --binary {file}   Convert raw float64 values, or a .npy file ('-' for stdin)\n");
+  fprintf (out, "  --client {socket} Send conversions to a server started with --serve\n");
+  fprintf (out, "  --col {column}:[{from}:]{to}\n");
+  fprintf (out, "                    Convert a column of --csv or --tsv input\n");
+  fprintf (out, "  --count           Print the number of values converted, instead of each result\n");
+  fprintf (out, "  --csv {file}      Convert columns of a CSV file ('-' for stdin)\n");
+  fprintf (out, "  --field {field}:[{from}:]{to}[={out}]\n");
+  fprintf (out, "                    Convert a member of --jsonl records\n");
+  fprintf (out, "  --float32         The --binary values are float32\n");
+  fprintf (out, "  --humanize        Print each result with the prefix that suits it\n");
+  fprintf (out, "  --in-place        Write the converted --binary values back to the file\n");
+  fprintf (out, "  --jsonl {file}    Convert members of JSON records, one per line ('-' for stdin)\n");
+  fprintf (out, "  --max             Print the largest result, instead of each one\n");
+  fprintf (out, "  --mean            Print the mean of the results, instead of each one\n");
+  fprintf (out, "  --min             Print the smallest result, instead of each one\n");
+  fprintf (out, "  --no-header       The --csv or --tsv input has no header\n");
+  fprintf (out, "  --scan {file}     Convert the quantities in text to the units given ('-' for stdin)\n");
+  fprintf (out, "  --serve {socket}  Serve conversions on a Unix domain socket\n");
+  fprintf (out, "  --stats           Print counts, timings and memory use to stderr at exit\n");
+  fprintf (out, "  --sum             Print the sum of the results, instead of each one\n");
+  fprintf (out, "  --tsv {file}      Convert columns of a TSV file ('-' for stdin)\n");
   }
 
 
 /*============================================================================
-  data_unit_type
+  option_argument
+  Get the argument of the option at argv[*i], which is the next one.
 ============================================================================*/
-int data_unit_type (Unit u)
+static const char *option_argument (int argc, char **argv, int *i, 
+    int *optind)
   {
-  switch (u)
+  if (*i + 1 >= argc)
     {
-    case kibibyte:
-    case mebibyte:
-    case gibibyte:
-    case tebibyte:
-    case pebibyte:
-    case exbibyte:
-    case kibibit:
-    case mebibit:
-    case gibibit:
-    case tebibit:
-    case pebibit:
-    case exbibit:
-      return iec_prefix;
-
-    case kilobyte:
-    case megabyte:
-    case gigabyte:
-    case terabyte:
-    case petabyte:
-    case exabyte:
-    case kilobit:
-    case megabit:
-    case gigabit:
-    case terabit:
-    case petabit:
-    case exabit:
-      return si_prefix;
-
-    default:
-      return no_prefix;
+    fprintf (stderr, "%s: Option %s requires an argument\n", argv[0], 
+      argv[*i]);
+    return NULL;
     }
+  (*optind)++;
+  return argv[++(*i)];
   }
 
 
 /*============================================================================
-  si_to_iec
+  aggregate_figure
+  The figure gathered for an option such as --sum, or 0 if the option
+  is not one of them.
 ============================================================================*/
-int si_to_iec (Unit u)
+static int aggregate_figure (const char *name)
   {
-  switch (u)
-    {
-    case kilobyte: return kibibyte;
-    case megabyte: return mebibyte;
-    case gigabyte: return gibibyte;
-    case terabyte: return tebibyte;
-    case petabyte: return pebibyte;
-    case exabyte: return exbibyte;
-    case kilobit: return kibibit;
-    case megabit: return mebibit;
-    case gigabit: return gibibit;
-    case terabit: return tebibit;
-    case petabit: return pebibit;
-    case exabit: return exbibit;
-    default: return u;
-    }
+  if (strcmp (name, "count") == 0) return batch_count;
+  if (strcmp (name, "sum") == 0) return batch_sum;
+  if (strcmp (name, "min") == 0) return batch_min;
+  if (strcmp (name, "max") == 0) return batch_max;
+  if (strcmp (name, "mean") == 0) return batch_mean;
+  return 0;
   }
 
 
 /*============================================================================
-  fractod
-  Like strtod(3) but also handles fractions in the form of "a/b" and "a b/c".
+  long_option
+  Handle the long option at argv[*i], and its argument, if it has one.
+  Returns FALSE if the option is not valid.
 ============================================================================*/
-double fractod (char *text, char **endptr)
+static BOOL long_option (int argc, char **argv, int *i, int *optind)
   {
-  double a, b, result = 0;
-  int length = 0, x;
+  const char *name = argv[*i] + 2;
+  int figure;
 
-  if (sscanf(text, "%d %lf / %lf %n", &x, &a, &b, &length) != EOF && length)
+  if (strcmp (name, "csv") == 0 || strcmp (name, "tsv") == 0)
     {
-    if (a < 0 || b <= 0 || a > b)
-      {
-      length = 0;
-      errno = EINVAL;
-      }
-    else
-      {
-      result = (double) x + (x < 0 ? -a / b : a / b);
-      errno = 0;
-      }
+    csv_separator = name[0] == 'c' ? ',' : '\t';
+    return (csv_file = option_argument (argc, argv, i, optind)) != NULL;
     }
-  else if (sscanf(text, "%lf / %lf %n", &a, &b, &length) != EOF && length)
+  else if (strcmp (name, "col") == 0)
     {
-    if (b <= 0)
+    const char *spec = option_argument (argc, argv, i, optind);
+    char *error = NULL;
+    if (!spec) return FALSE;
+    csv_columns = realloc (csv_columns, 
+      (n_csv_columns + 1) * sizeof (CsvColumn));
+    if (!csv_column_parse (&csv_columns[n_csv_columns], spec, &error))
       {
-      length = 0;
-      errno = EINVAL;
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      return FALSE;
       }
-    else
+    n_csv_columns++;
+    return TRUE;
+    }
+  else if (strcmp (name, "jsonl") == 0)
+    return (json_file = option_argument (argc, argv, i, optind)) != NULL;
+  else if (strcmp (name, "field") == 0)
+    {
+    const char *spec = option_argument (argc, argv, i, optind);
+    char *error = NULL;
+    if (!spec) return FALSE;
+    json_fields = realloc (json_fields, 
+      (n_json_fields + 1) * sizeof (JsonField));
+    if (!json_field_parse (&json_fields[n_json_fields], spec, &error))
       {
-      result = a / b;
-      errno = 0;
+      fprintf (stderr, "%s: %s\n", argv[0], error);
+      free (error);
+      return FALSE;
       }
+    n_json_fields++;
+    return TRUE;
     }
-  else if (sscanf(text, "%lf %n", &a, &length) != EOF && length)
+  else if (strcmp (name, "binary") == 0)
+    return (binary_file = option_argument (argc, argv, i, optind)) != NULL;
+  else if (strcmp (name, "scan") == 0)
+    return (scan_file = option_argument (argc, argv, i, optind)) != NULL;
+  else if (strcmp (name, "serve") == 0)
+    return (serve_path = option_argument (argc, argv, i, optind)) != NULL;
+  else if (strcmp (name, "client") == 0)
+    return (client_path = option_argument (argc, argv, i, optind)) != NULL;
+  else if (strcmp (name, "autocorrect") == 0)
     {
-    result = a;
-    errno = 0;
+    options.autocorrect = TRUE;
+    return TRUE;
     }
-  else if (*text == '\0')
-    errno = EINVAL;
-
-  if (endptr)
-    *endptr = text + length;
-
-  return result;
-  }
-
-
-/*============================================================================
-  convert
-  Perform a conversion of one unit to another. If the value and units are
-  separate strings, they are passed in as "from" and "from_units_suffix",
-  respectively. If they are concatenated, "from" should point to the whole
-  string while "from_units_suffix" should be set to NULL.
-============================================================================*/
-int convert (char *from, char *from_units_suffix, char *to)
-  {
-  static char* previous_from_units_suffix = NULL;
-
-  double value;
-  char *error = NULL, *invalid = NULL;
-  errno = 0;
-  Units *fu = NULL, *tu = NULL;
-
-  if (from_units_suffix)
+  else if (strcmp (name, "float32") == 0)
     {
-    value = fractod (from, &invalid);
-    // If fractod parsed the entire string, ensure "invalid" is set to NULL.
-    if (errno == 0 && invalid && *invalid == '\0') invalid = NULL;
+    binary_type = binary_float32;
+    return TRUE;
     }
-  else
+  else if (strcmp (name, "humanize") == 0)
     {
-    value = fractod (from, &from_units_suffix);
-    if (errno != 0 || from == from_units_suffix)
-      {
-      invalid = from;
-      if (from != from_units_suffix) *from = '\0'; // Don't include units in error.
-      }
-    else if (*from_units_suffix == '\0')
-      {
-      if (!previous_from_units_suffix)
-        {
-        fprintf (stderr, "No units specified for input value '%s'\n", from);
-        return 1;
-        }
-
-      // If the "from" value does not include units but a previous call did, we
-      // reuse the units from the previous call.
-      from_units_suffix = previous_from_units_suffix;
-      }
+    options.humanize = TRUE;
+    return TRUE;
     }
-
-  if (invalid)
+  else if (strcmp (name, "in-place") == 0)
     {
-    fprintf (stderr, "%s: %s\n", invalid, errno == 0 ? "Not a valid number" : strerror(errno));
-    return 1;
+    binary_in_place = TRUE;
+    return TRUE;
+    }
+  else if (strcmp (name, "no-header") == 0)
+    {
+    csv_header = FALSE;
+    return TRUE;
+    }
+  else if ((figure = aggregate_figure (name)) != 0)
+    {
+    aggregate_figures |= figure;
+    return TRUE;
+    }
+  else if (strcmp (name, "stats") == 0)
+    {
+    options.stats = &stats;
+    return TRUE;
     }
 
-  fu = units_parse (from_units_suffix, &error);
-  if (!fu) goto done;
+  fprintf (stderr, "%s: Unknown option %s\n", argv[0], argv[*i]);
+  return FALSE;
+  }
 
-  tu = units_parse (to, &error);
-  if (!tu) goto done;
 
-  // When defaulting to IEC units, only convert to IEC units if all
-  // inputs are SI units. This allows conversion of SI to IEC by mixing
-  // unit types e.g. "10 gb gib".
-  if (default_to_iec)
-    {
-    int i, counts[digital_storage_prefix_enum_count] = {0};
+/*============================================================================
+  open_input
+  Open a file named on the command line, or stdin for "-".
+============================================================================*/
+static FILE *open_input (const char *name)
+  {
+  if (strcmp (name, "-") == 0) return stdin;
+  FILE *in = fopen (name, "r");
+  if (!in)
+    fprintf (stderr, "%s: %s\n", name, strerror (errno));
+  return in;
+  }
 
-    for (i = 0; i < fu->n_elements; i++)
-      counts[data_unit_type (fu->units[i].unit)]++;
 
-    for (i = 0; i < tu->n_elements; i++)
-      counts[data_unit_type (tu->units[i].unit)]++;
+/*============================================================================
+  print_stats
+============================================================================*/
+static void print_stats (void)
+  {
+  stats_print (&stats, stderr);
+  }
 
-    if (counts[si_prefix] && !counts[iec_prefix])
-      {
-      for (i = 0; i < fu->n_elements; i++)
-        fu->units[i].unit = si_to_iec (fu->units[i].unit);
 
-      for (i = 0; i < tu->n_elements; i++)
-        tu->units[i].unit = si_to_iec (tu->units[i].unit);
-      }
-    }
+/*============================================================================
+  start_aggregate
+  Start gathering results for --sum and the like, if they are wanted.
+  The figures are in the units converted to as they read on their own,
+  whatever the units of the values, so that the order of the values 
+  makes no difference. Returns FALSE if the units are not valid.
+============================================================================*/
+static BOOL start_aggregate (const Converter *converter, const char *to)
+  {
+  Units units;
+  char *error = NULL;
 
-  double res = units_convert (value, fu, tu, &error);
-  if (!error)
+  if (!aggregate_figures) return TRUE;
+  if (!converter_parse_target (converter, to, &units, &error))
     {
-    previous_from_units_suffix = from_units_suffix;
-    char *fs = units_format_string_and_value (fu, value, force_decimal);
-    char *ts = units_format_string_and_value (tu, res, force_decimal);
-    printf ("%s = %s\n", fs, ts);
+    fprintf (stderr, "Error: %s\n", error);
+    free (error);
+    return FALSE;
     }
+  batch_aggregate_init (&aggregate, aggregate_figures, &units);
+  options.aggregate = &aggregate;
+  return TRUE;
+  }
 
-done:
-  if (error) fprintf (stderr, "Error: %s\n", error);
 
-  free(fu);
-  free(tu);
-  free(error);
-  return error ? 1 : 0;
+/*============================================================================
+  print_aggregate
+  Print the results gathered, if they were being gathered, and add the
+  status of doing so to that of the conversions.
+============================================================================*/
+static int print_aggregate (int status)
+  {
+  if (options.aggregate)
+    status |= batch_aggregate_print (&aggregate, &options, stdout, stderr);
+  return status;
   }
 
+
 /*============================================================================
   main
 ============================================================================*/
@@ -273,6 +317,9 @@ int main (int argc, char **argv)
   BOOL list = FALSE;
   BOOL version = FALSE;
   BOOL multiple_inputs = FALSE;
+  BOOL interactive = FALSE;
+  const char *input_file = NULL;
+  Converter converter;
 
   // We have to parse the arguments manually, because the first argument
   //  might be a negative number
@@ -285,16 +332,25 @@ int main (int argc, char **argv)
         {
         if (!isdigit ((int)argv[i][1]))
           {
-          int j, l = strlen (argv[i]);
+          const char *opts = argv[i];
+          int j, l = strlen (opts);
+          if (opts[1] == '-')
+            {
+            // Long options can't be combined. "--" alone ends the options
+            optind++;
+            if (l == 2) break;
+            if (!long_option (argc, argv, &i, &optind)) return 1;
+            continue;
+            }
           for (j = 1; j < l; j++)
             {
-            switch (argv[i][j])
+            switch (opts[j])
               {
               case 'd':
-                force_decimal =TRUE;
+                options.force_decimal =TRUE;
                 break;
               case 's':
-                default_to_iec =FALSE;
+                options.default_to_iec =FALSE;
                 break;
               case 'v':
                 version =TRUE;
@@ -305,6 +361,38 @@ int main (int argc, char **argv)
               case 'm':
                 multiple_inputs =TRUE;
                 break;
+              case 'i':
+                interactive =TRUE;
+                break;
+              case 'r':
+                options.number_format = units_format_roundtrip;
+                break;
+              case 'f':
+                if (i + 1 < argc)
+                  {
+                  input_file = argv[++i];
+                  optind++;
+                  }
+                else
+                  {
+                  fprintf (stderr, "%s: Option -f requires a file name\n", argv[0]);
+                  return 1;
+                  }
+                break;
+              case 'j':
+                if (i + 1 < argc && atoi (argv[i + 1]) > 0)
+                  {
+                  options.threads = atoi (argv[++i]);
+                  if (options.threads > BATCH_MAX_THREADS)
+                    options.threads = BATCH_MAX_THREADS;
+                  optind++;
+                  }
+                else
+                  {
+                  fprintf (stderr, "%s: Option -j requires a number of threads\n", argv[0]);
+                  return 1;
+                  }
+                break;
               case 'h':
                 usage =TRUE;
                 break;
@@ -336,33 +424,183 @@ int main (int argc, char **argv)
     exit(0);
     }
 
-  if (!multiple_inputs)
+  if (options.stats)
+    {
+    stats_start ();
+    atexit (print_stats);
+    }
+
+  if (aggregate_figures && (serve_path || client_path || interactive ||
+      csv_file || json_file || scan_file || binary_file))
+    {
+    fprintf (stderr, "%s: --count, --sum, --min, --max and --mean are only for values given as arguments or read with -f\n", argv[0]);
+    return 1;
+    }
+
+  if (serve_path)
+    {
+    if (argc != optind)
+      {
+      fprintf (stderr, "%s: Unexpected arguments for use with --serve\n", argv[0]);
+      return 1;
+      }
+    return serve_run (serve_path, &options);
+    }
+
+  if (client_path)
+    {
+    if (argc - optind == 1 || argc - optind > 3)
+      {
+      fprintf (stderr, "%s: Wrong number of arguments for use with --client; expected 0, 2 or 3\n", argv[0]);
+      return 1;
+      }
+    return serve_client (client_path, argc - optind, argv + optind);
+    }
+
+  if (interactive)
+    {
+    if (argc != optind)
+      {
+      fprintf (stderr, "%s: Unexpected arguments for use with -i\n", argv[0]);
+      return 1;
+      }
+    return repl_run (stdin, &options);
+    }
+
+  if (csv_file)
+    {
+    if (argc != optind)
+      {
+      fprintf (stderr, "%s: Unexpected arguments for use with --csv or --tsv\n", argv[0]);
+      return 1;
+      }
+    if (n_csv_columns == 0)
+      {
+      fprintf (stderr, "%s: No columns to convert; use --col\n", argv[0]);
+      return 1;
+      }
+
+    FILE *in = open_input (csv_file);
+    if (!in) return 1;
+    int status = csv_convert_file (in, csv_separator, csv_columns, 
+      n_csv_columns, csv_header, &options);
+    if (in != stdin) fclose (in);
+    for (i = 0; i < n_csv_columns; i++)
+      csv_column_destroy (&csv_columns[i]);
+    free (csv_columns);
+    return status;
+    }
+
+  if (json_file)
+    {
+    if (argc != optind)
+      {
+      fprintf (stderr, "%s: Unexpected arguments for use with --jsonl\n", argv[0]);
+      return 1;
+      }
+    if (n_json_fields == 0)
+      {
+      fprintf (stderr, "%s: No fields to convert; use --field\n", argv[0]);
+      return 1;
+      }
+
+    FILE *in = open_input (json_file);
+    if (!in) return 1;
+    int status = json_convert_file (in, json_fields, n_json_fields, 
+      &options);
+    if (in != stdin) fclose (in);
+    for (i = 0; i < n_json_fields; i++)
+      json_field_destroy (&json_fields[i]);
+    free (json_fields);
+    return status;
+    }
+
+  if (scan_file)
+    {
+    if (argc == optind)
+      {
+      fprintf (stderr, "%s: No units to convert to; expected at least 1 for use with --scan\n", argv[0]);
+      return 1;
+      }
+
+    FILE *in = open_input (scan_file);
+    if (!in) return 1;
+    int status = scan_convert_file (in, scan_file, argc - optind, 
+      argv + optind, &options);
+    if (in != stdin) fclose (in);
+    return status;
+    }
+
+  // From here on, every path comes to the end, so that the converter is
+  //  destroyed
+  int status = 1;
+  batch_converter_init (&converter, &options);
+
+  if (binary_file)
+    {
+    double value, res;
+    char *error = NULL;
+
+    if ((argc - optind) != 2)
+      fprintf (stderr, "%s: Wrong number of arguments for use with --binary; expected 2\n", argv[0]);
+    else if (binary_in_place && strcmp (binary_file, "-") == 0)
+      fprintf (stderr, "%s: Standard input can't be converted in place\n", argv[0]);
+    // Plan the conversion as for any other, so that the units are read
+    //  in the same way
+    else if (converter_convert (&converter, "1", argv[optind], 
+        argv[optind + 1], &value, &res, &error) != converter_ok)
+      {
+      fprintf (stderr, "Error: %s\n", error);
+      free (error);
+      }
+    else
+      status = binary_convert_file (binary_file, binary_type, 
+        binary_in_place, &converter.plan);
+    }
+  else if (input_file)
+    {
+    FILE *in;
+    if ((argc - optind) != 1)
+      fprintf (stderr, "%s: Wrong number of arguments for use with -f; expected 1\n", argv[0]);
+    else if (start_aggregate (&converter, argv[optind]) && 
+        (in = open_input (input_file)))
+      {
+      status = batch_convert_file (in, argv[optind], &options);
+      if (in != stdin) fclose (in);
+      status = print_aggregate (status);
+      }
+    }
+  else if (!multiple_inputs)
     {
     switch (argc - optind)
       {
       case 2:
-        return convert(argv[optind], NULL, argv[optind + 1]);
+        if (start_aggregate (&converter, argv[optind + 1]))
+          status = print_aggregate (batch_convert (&converter, argv[optind], 
+            NULL, argv[optind + 1], &options, stdout, stderr));
+        break;
       case 3:
-        return convert(argv[optind], argv[optind + 1], argv[optind + 2]);
+        if (start_aggregate (&converter, argv[optind + 2]))
+          status = print_aggregate (batch_convert (&converter, argv[optind], 
+            argv[optind + 1], argv[optind + 2], &options, stdout, stderr));
+        break;
       default:
         fprintf (stderr, "%s: Wrong number of arguments; expected 2 or 3\n",
           argv[0]);
         show_usage (argv[0], stderr);
-        return 1;
       }
     }
   else if ((argc - optind) < 2)
-    {
     fprintf (stderr, "%s: Wrong number of arguments for use with -m; expected at least 2\n", argv[0]);
-    return 1;
-    }
-  else
+  else if (start_aggregate (&converter, argv[argc - 1]))
     {
-    int status = 0;
-
+    status = 0;
     for (int i = 0; i < argc - optind - 1; i++)
-      status |= convert(argv[optind + i], NULL, argv[argc - 1]);
-
-    return status;
+      status |= batch_convert (&converter, argv[optind + i], NULL, 
+        argv[argc - 1], &options, stdout, stderr);
+    status = print_aggregate (status);
     }
+
+  converter_destroy (&converter);
+  return status;
   }
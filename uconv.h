@@ -0,0 +1,22 @@
+/*============================================================================
+  uconv.h
+
+  Public header for libuconv. Programs using the library need include
+  only this file, and link with -luconv -lm.
+
+  All functions are reentrant, and none keeps state between calls except
+  through objects owned by the caller (Units, UnitsPlan, Converter), so 
+  the library can be used from any number of threads without locking, 
+  provided that no one object is shared between threads while it is 
+  being modified. Errors are reported by return value and an error message
+  that the caller frees; the library never prints or exits.
+
+  (c)2013-2026 Kevin Boone and others
+  Distributed under the terms of the GNU Public Licence, version 2
+============================================================================*/
+
+#pragma once
+
+#include "units.h"
+#include "converter.h"
+
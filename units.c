@@ -10,8 +10,18 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "units.h"
 
+// Select vector implementations of units_convert_array at run time, where
+//  the compiler lets us build them and ask the CPU which it supports
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UNITS_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
 /*============================================================================
   conversion factors 
 ============================================================================*/
@@ -33,7 +43,7 @@ typedef struct _UnitTable
   } UnitTable;
 
 
-UnitTable unit_table [] = 
+static const UnitTable unit_table [] = 
   { 
   { atmosphere, "atmosphere", "atm", "atmosphere" ,"atmospheres" },
   { acre, "acre", "", "acre (international)", "acres" },
@@ -200,7 +210,7 @@ typedef struct _ConvTable
   } ConvTable;
 
 
-ConvTable conv_table [] = 
+static const ConvTable conv_table [] = 
   {
   // Temperature
   // These are only used for conversions involving rates.
@@ -399,11 +409,12 @@ ConvTable conv_table [] =
   {  exbibyte, 1, {1, {{ byte, 1, 0}}}, 1152921504606846976.0L },
 
   {  bit, 1, {1, {{ byte, 1, 0}}}, 0.125 },
-  {  megabit, 1, {1, {{ byte, 1, 0}}}, 125 },
-  {  gigabit, 1, {1, {{ byte, 1, 0}}}, 125e3 },
-  {  terabit, 1, {1, {{ byte, 1, 0}}}, 125e6 },
-  {  petabit, 1, {1, {{ byte, 1, 0}}}, 125e9 },
-  {  exabit, 1, {1, {{ byte, 1, 0}}}, 125e12 },
+  {  kilobit, 1, {1, {{ byte, 1, 0}}}, 125 },
+  {  megabit, 1, {1, {{ byte, 1, 0}}}, 125e3 },
+  {  gigabit, 1, {1, {{ byte, 1, 0}}}, 125e6 },
+  {  terabit, 1, {1, {{ byte, 1, 0}}}, 125e9 },
+  {  petabit, 1, {1, {{ byte, 1, 0}}}, 125e12 },
+  {  exabit, 1, {1, {{ byte, 1, 0}}}, 125e15 },
 
   {  kibibit, 1, {1, {{ byte, 1, 0}}}, 128.0 },
   {  mebibit, 1, {1, {{ byte, 1, 0}}}, 131072.0 },
@@ -417,144 +428,619 @@ ConvTable conv_table [] =
 
 
 /*============================================================================
-  unit_find_unit_by_name
+  Dimensions
+  The base units that conv_table reduces everything to are the dimensions
+  of a quantity, held as the power of each base unit. The powers are also
+  packed into one integer, DIMENSION_BITS to each, as the sum of 
+  power * 2^(DIMENSION_BITS * i) for base unit i. So long as no power is
+  larger than MAX_DIMENSION_POWER, each set of dimensions has only one 
+  packed value, and two sets of units can be compared with a single test
+  of it, or of its negation for inverse units. Larger powers are rare,
+  and are compared one base unit at a time.
 ============================================================================*/
-Unit units_find_unit_by_name (const char *name)
+#define DIMENSION_BITS 7
+#define MAX_DIMENSION_POWER ((1 << (DIMENSION_BITS - 1)) - 1)
+
+static const Unit base_units [] = 
+  {
+  meter, gramme, second, newton, ampere, byte, radian, steradian, fahrenheit
+  };
+
+#define N_BASE_UNITS ((int)(sizeof (base_units) / sizeof (base_units[0])))
+#define N_CONV_TABLE ((int)(sizeof (conv_table) / sizeof (conv_table[0])))
+
+typedef struct _UnitsDimension
+  {
+  int64_t powers[N_BASE_UNITS];
+  BOOL packable; // TRUE if no power is larger than MAX_DIMENSION_POWER
+  int64_t packed; // Only if packable
+  } UnitsDimension;
+
+// The power of each base unit in each row of conv_table
+static int conv_powers [N_CONV_TABLE][N_BASE_UNITS];
+
+
+/*============================================================================
+  units_build_dimensions
+============================================================================*/
+static void units_build_dimensions (void)
+  {
+  int i, j, k;
+  for (i = 0; conv_table[i].working_unit > 0; i++)
+    {
+    const Units *base = &conv_table[i].base_unit;
+    for (j = 0; j < base->n_elements; j++)
+      {
+      for (k = 0; k < N_BASE_UNITS; k++)
+        if (base_units[k] == base->units[j].unit) break;
+      conv_powers[i][k] += base->units[j].power;
+      }
+    }
+  }
+
+
+/*============================================================================
+  units_pack_dimension
+  Pack the powers of the base units, if none is too large. Multiplied, not
+  shifted, because a power may be negative.
+============================================================================*/
+static void units_pack_dimension (UnitsDimension *self)
+  {
+  int k;
+  self->packable = TRUE;
+  self->packed = 0;
+  for (k = 0; k < N_BASE_UNITS && self->packable; k++)
+    {
+    if (llabs (self->powers[k]) > MAX_DIMENSION_POWER)
+      self->packable = FALSE;
+    else
+      self->packed += self->powers[k] * 
+        ((int64_t)1 << (DIMENSION_BITS * k));
+    }
+  }
+
+
+/*============================================================================
+  units_compare_dimensions
+  Returns TRUE if the dimensions a are those of b, raised to the power sign,
+  which is 1 or -1. 
+============================================================================*/
+static BOOL units_compare_dimensions (const UnitsDimension *a, 
+    const UnitsDimension *b, int sign)
+  {
+  int k;
+  if (a->packable != b->packable) return FALSE;
+  if (a->packable) return a->packed == sign * b->packed;
+  for (k = 0; k < N_BASE_UNITS; k++)
+    if (a->powers[k] != sign * b->powers[k]) return FALSE;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  name index
+  Case-insensitive hash of every long name, plural name and alternative
+  name in unit_table, using open addressing and linear probing. The
+  index is built once, on first lookup, and thereafter a lookup neither
+  scans the table nor allocates. Names are stored as pointers into the
+  table strings, with a length, because alternative names are not 
+  NUL-terminated individually. Where the same name appears in more than one
+  row, the earliest row wins, just as it did with the linear scan.
+============================================================================*/
+
+// Number of slots; must be a power of two, and comfortably more than
+//  the number of names in unit_table (about 480)
+#define NAME_INDEX_SIZE 1024
+
+typedef struct _NameIndexEntry
+  {
+  const char *name; // NULL for an empty slot
+  int length;
+  int row;          // index into unit_table
+  } NameIndexEntry;
+
+static NameIndexEntry name_index [NAME_INDEX_SIZE];
+
+
+/*============================================================================
+  units_hash_name
+  FNV-1a over the lower-cased characters of the first length characters
+  of name
+============================================================================*/
+static unsigned int units_hash_name (const char *name, int length)
+  {
+  unsigned int h = 2166136261U;
+  int i;
+  for (i = 0; i < length; i++)
+    {
+    h ^= (unsigned char) tolower ((unsigned char) name[i]);
+    h *= 16777619U;
+    }
+  return h;
+  }
+
+
+/*============================================================================
+  units_name_index_add
+============================================================================*/
+static void units_name_index_add (const char *name, int length, int row)
+  {
+  // Strip the stray spaces that appear in some of the alt_names lists
+  while (length > 0 && isspace ((unsigned char) *name)) 
+    {
+    name++;
+    length--;
+    }
+  while (length > 0 && isspace ((unsigned char) name[length - 1])) 
+    length--;
+  if (length == 0) return;
+
+  unsigned int slot = units_hash_name (name, length) & (NAME_INDEX_SIZE - 1);
+  while (name_index[slot].name)
+    {
+    if (name_index[slot].length == length && 
+        strncasecmp (name_index[slot].name, name, length) == 0)
+      return; // An earlier row already claims this name
+    slot = (slot + 1) & (NAME_INDEX_SIZE - 1);
+    }
+  name_index[slot].name = name;
+  name_index[slot].length = length;
+  name_index[slot].row = row;
+  }
+
+
+/*============================================================================
+  units_build_name_index
+============================================================================*/
+static void units_build_name_index (void)
   {
   int i = 0;
   while (unit_table[i].unit > 0)
     {
-    if (strcasecmp (name, unit_table[i].long_name) == 0) return unit_table[i].unit;
-    if (strcasecmp (name, unit_table[i].plural_long_name) == 0) return unit_table[i].unit;
-    char *alt_names = strdup (unit_table[i].alt_names);
-    char *tok = strtok (alt_names, ",");
-    while (tok)
+    const char *name = unit_table[i].long_name;
+    units_name_index_add (name, strlen (name), i);
+    name = unit_table[i].plural_long_name;
+    units_name_index_add (name, strlen (name), i);
+    name = unit_table[i].alt_names;
+    for (;;)
       {
-      if (strcasecmp (name, tok) == 0)
+      const char *comma = strchr (name, ',');
+      if (!comma)
         {
-        free (alt_names);
-        return unit_table[i].unit;
+        units_name_index_add (name, strlen (name), i);
+        break;
         }
-  
-      tok = strtok (NULL, ", ");
+      units_name_index_add (name, comma - name, i);
+      name = comma + 1;
       }
-    free (alt_names);
     i++;
     }
-  return -1;
   }
 
 
+static void units_build_prefix_index (void);
+static void units_build_human_index (void);
+static void units_select_array_kernel (void);
+
 /*============================================================================
-  units_format_prefix_name
+  units_init_once
 ============================================================================*/
-const char *units_format_prefix_name (int prefix_power)
+static void units_init_once (void)
   {
-  switch (prefix_power)
-    {
-    case 0: return "";
-    case -12: return "pico";
-    case -9: return "nano";
-    case -6: return "micro";
-    case -3: return "milli";
-    case -2: return "centi";
-    case -1: return "deci";
-    case 3: return "kilo";
-    case 6: return "mega";
-    case 9: return "giga";
-    case 12: return "tera";
-    }
-  return "?";
+  units_build_name_index ();
+  units_build_prefix_index ();
+  units_build_dimensions ();
+  units_build_human_index ();
+  units_select_array_kernel ();
+  }
+
+
+/*============================================================================
+  units_init
+  Build the tables that are computed at run time. This is called 
+  automatically by the functions that need it, and is safe to call from
+  any number of threads; it need only be called explicitly by a program
+  that wants to pay the (small) cost of initialization up front. 
+============================================================================*/
+void units_init (void)
+  {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once (&once, units_init_once);
   }
 
 
 /*============================================================================
-  unit_find_prefix
-  Returns 0 if there is no prefix. Happily, there is no prefix for 10^0
+  unit_find_unit_by_name
 ============================================================================*/
-int units_find_prefix (const char *s, int *skip)
+Unit units_find_unit_by_name (const char *name)
   {
-  // Note -- longest prefixes must test first
+  units_init ();
 
-  if (strncmp (s, "tera", 4) == 0) { *skip = 4; return 12; }
-  if (s[0] == 'T') { *skip = 1; return 12; }
+  int length = strlen (name);
+  if (length == 0) return -1;
 
-  if (strncmp (s, "giga", 4) == 0) { *skip = 4; return 9; }
-  if (s[0] == 'G') { *skip = 1; return 9; }
+  unsigned int slot = units_hash_name (name, length) & (NAME_INDEX_SIZE - 1);
+  while (name_index[slot].name)
+    {
+    if (name_index[slot].length == length && 
+        strncasecmp (name_index[slot].name, name, length) == 0)
+      return unit_table[name_index[slot].row].unit;
+    slot = (slot + 1) & (NAME_INDEX_SIZE - 1);
+    }
+  return -1;
+  }
 
-  if (strncmp (s, "mega", 4) == 0) { *skip = 4; return 6; }
-  if (s[0] == 'M') { *skip = 1; return 6; }
 
-  if (strncmp (s, "kilo", 4) == 0) { *skip = 4; return 3; }
-  if (s[0] == 'k') { *skip = 1; return 3; }
+/*============================================================================
+  Prefixes
+  The SI prefixes, in long and symbol form. A name is looked up with a
+  prefix only if it is not a unit name by itself; then the prefixes that
+  start with its first character are tried, longest first, until one is
+  followed by a unit name. Prefixes are case-sensitive.
+============================================================================*/
+typedef struct _UnitsPrefix
+  {
+  const char *name;
+  int power;
+  } UnitsPrefix;
 
-  if (strncmp (s, "deci", 4) == 0) { *skip = 4; return -1; }
-  if (s[0] == 'd') { *skip = 1; return -1; }
+static const UnitsPrefix prefix_table[] = 
+  {
+  // Long forms first, so units_format_prefix_name finds them
+  { "quetta", 30 }, { "ronna", 27 }, { "yotta", 24 }, { "zetta", 21 },
+  { "exa", 18 }, { "peta", 15 }, { "tera", 12 }, { "giga", 9 },
+  { "mega", 6 }, { "kilo", 3 }, { "hecto", 2 }, { "deca", 1 },
+  { "deci", -1 }, { "centi", -2 }, { "milli", -3 }, { "micro", -6 },
+  { "nano", -9 }, { "pico", -12 }, { "femto", -15 }, { "atto", -18 },
+  { "zepto", -21 }, { "yocto", -24 }, { "ronto", -27 }, { "quecto", -30 },
+  { "deka", 1 },
+  { "Q", 30 }, { "R", 27 }, { "Y", 24 }, { "Z", 21 }, { "E", 18 },
+  { "P", 15 }, { "T", 12 }, { "G", 9 }, { "M", 6 }, { "k", 3 }, { "h", 2 },
+  { "da", 1 }, { "d", -1 }, { "c", -2 }, { "m", -3 }, { "u", -6 },
+  { "\xc2\xb5", -6 }, { "\xce\xbc", -6 }, // Micro sign and Greek mu
+  { "n", -9 }, { "p", -12 }, { "f", -15 }, { "a", -18 }, { "z", -21 },
+  { "y", -24 }, { "r", -27 }, { "q", -30 },
+  { NULL, 0 }
+  };
 
-  if (strncmp (s, "nano", 4) == 0) { *skip = 4; return -9; }
-  if (s[0] == 'n') { *skip = 1; return -9; }
+// No character starts more prefixes than this ('d': deca, deka, deci, 
+//  da, d)
+#define MAX_PREFIXES_PER_CHARACTER 6
 
-  if (strncmp (s, "pico", 4) == 0) { *skip = 4; return -12; }
-  if (s[0] == 'p') { *skip = 1; return -12; }
+// For each first character, the prefixes that start with it, longest
+//  first, ending with NULL
+static const UnitsPrefix *prefix_index [256][MAX_PREFIXES_PER_CHARACTER + 1];
 
-  if (strncmp (s, "centi", 5) == 0) { *skip = 5; return -2; }
-  if (s[0] == 'c') { *skip = 1; return -2; }
 
-  if (strncmp (s, "milli", 5) == 0) { *skip = 5; return -3; }
-  if (strncmp (s, "micro", 5) == 0) { *skip = 5; return -6; }
-  if (s[0] == 'm') { *skip = 1; return -3; }
+/*============================================================================
+  units_build_prefix_index
+============================================================================*/
+static void units_build_prefix_index (void)
+  {
+  const UnitsPrefix *p;
+  for (p = prefix_table; p->name; p++)
+    {
+    const UnitsPrefix **list = prefix_index[(unsigned char)p->name[0]];
+    int i, n = 0;
+    while (list[n]) n++;
+    for (i = n; i > 0 && strlen (list[i - 1]->name) < strlen (p->name); i--)
+      list[i] = list[i - 1];
+    list[i] = p;
+    }
+  }
 
-  if (s[0] == 'u') { *skip = 1; return -6; }
 
-  return 0;
+/*============================================================================
+  units_format_prefix_name
+============================================================================*/
+const char *units_format_prefix_name (int prefix_power)
+  {
+  const UnitsPrefix *p;
+  if (prefix_power == 0) return "";
+  for (p = prefix_table; p->name; p++)
+    if (p->power == prefix_power) return p->name;
+  return "?";
   }
 
 
 /*============================================================================
   unit_find_unit_by_name_and_prefix
+  Look up a unit name, which might have a prefix if allow_prefix is set.
+  The power of the prefix, or 0, is stored in *pref_pow.
 ============================================================================*/
 Unit units_find_unit_by_name_and_prefix (const char *name, int *pref_pow, 
     BOOL allow_prefix)
   {
-  if (allow_prefix)
+  const UnitsPrefix **p;
+  Unit u = units_find_unit_by_name (name);
+
+  *pref_pow = 0;
+  if ((int)u > 0 || !allow_prefix) return u;
+
+  units_init ();
+  for (p = prefix_index[(unsigned char)*name]; *p; p++)
     {
-    int dummy;
-    Unit u = units_find_unit_by_name_and_prefix (name, &dummy, FALSE);
-    if ((int)u > 0)
+    size_t length = strlen ((*p)->name);
+    if (strncmp (name, (*p)->name, length) == 0)
       {
-      pref_pow = 0;
-      return u;
-      } 
+      u = units_find_unit_by_name (name + length);
+      if ((int)u > 0)
+        {
+        *pref_pow = (*p)->power;
+        return u;
+        }
+      }
     }
+  return u;
+  }
+
+
+/*============================================================================
+  Suggestions
+  When a unit name is not found, the names closest to it by edit distance
+  are suggested. Every name in name_index is put into a BK-tree, in which 
+  each child of a node is at a different distance from it; because edit 
+  distance is a metric, only the children whose distance from their parent
+  is within the limit of the query's distance from the parent can hold a 
+  match, and the rest of the tree is never visited. The tree is built the
+  first time a name is not found, so nothing is spent on it otherwise.
+============================================================================*/
+
+// A name is compared with others no more than this many edits away;
+//  shorter names get fewer, so that they are not "close" to everything
+#define SUGGEST_MAX_DISTANCE 2
+#define SUGGEST_DISTANCE_LIMIT(length) \
+  ((length) < 3 ? 0 : (length) < 6 ? 1 : SUGGEST_MAX_DISTANCE)
+
+// Most names to suggest, and most candidates kept while searching
+#define MAX_SUGGESTIONS 3
+#define MAX_SUGGEST_CANDIDATES 16
+
+typedef struct _SuggestNode
+  {
+  const char *name; // Not NUL-terminated; see name_index
+  char folded[MAX_UNIT_STRING]; // The name in lower case, for comparing
+  int length;
+  int row;          // index into unit_table
+  int distance;     // From the parent
+  int first_child;  // index into suggest_tree, or -1
+  int next_sibling;
+  } SuggestNode;
+
+static SuggestNode suggest_tree [NAME_INDEX_SIZE];
+static int suggest_tree_size;
+
+typedef struct _SuggestCandidate
+  {
+  int distance;
+  const UnitsPrefix *prefix; // Or NULL
+  const SuggestNode *node;
+  } SuggestCandidate;
+
 
-  int skip;
-  int test_pow;
+/*============================================================================
+  units_edit_distance
+  Levenshtein distance. Names are compared in lower case, as they are 
+  looked up, so they are folded before they get here.
+============================================================================*/
+static int units_edit_distance (const char *a, int la, const char *b, 
+    int lb)
+  {
+  int row[MAX_UNIT_STRING + 1];
+  int i, j;
 
-  if (allow_prefix)
+  if (la > MAX_UNIT_STRING) la = MAX_UNIT_STRING;
+  if (lb > MAX_UNIT_STRING) lb = MAX_UNIT_STRING;
+  for (j = 0; j <= lb; j++) row[j] = j;
+  for (i = 1; i <= la; i++)
     {
-    *pref_pow = 0;
-    skip = 0;
-    test_pow = units_find_prefix (name, &skip);
+    int diagonal = row[0];
+    row[0] = i;
+    for (j = 1; j <= lb; j++)
+      {
+      int above = row[j];
+      int d = diagonal + (a[i - 1] != b[j - 1]);
+      if (above + 1 < d) d = above + 1;
+      if (row[j - 1] + 1 < d) d = row[j - 1] + 1;
+      row[j] = d;
+      diagonal = above;
+      }
     }
-  else
+  return row[lb];
+  }
+
+
+/*============================================================================
+  units_build_suggest_tree
+============================================================================*/
+static void units_build_suggest_tree (void)
+  {
+  int i;
+  for (i = 0; i < NAME_INDEX_SIZE; i++)
     {
-    test_pow = 0;
-    skip = 0;
+    const NameIndexEntry *entry = &name_index[i];
+    if (!entry->name) continue;
+
+    SuggestNode *node = &suggest_tree[suggest_tree_size];
+    int j;
+    node->name = entry->name;
+    node->length = entry->length;
+    if (node->length > MAX_UNIT_STRING) node->length = MAX_UNIT_STRING;
+    for (j = 0; j < node->length; j++)
+      node->folded[j] = tolower ((unsigned char)node->name[j]);
+    node->row = entry->row;
+    node->first_child = node->next_sibling = -1;
+    if (suggest_tree_size > 0)
+      {
+      SuggestNode *parent = &suggest_tree[0];
+      for (;;)
+        {
+        int d = units_edit_distance (node->folded, node->length, 
+          parent->folded, parent->length), child;
+        for (child = parent->first_child; child >= 0; 
+            child = suggest_tree[child].next_sibling)
+          if (suggest_tree[child].distance == d) break;
+        if (child < 0)
+          {
+          node->distance = d;
+          node->next_sibling = parent->first_child;
+          parent->first_child = suggest_tree_size;
+          break;
+          }
+        parent = &suggest_tree[child];
+        }
+      }
+    suggest_tree_size++;
     }
+  }
+
 
-  if (test_pow != 0)
+/*============================================================================
+  units_suggest_add
+  Keep a candidate, if it is closer than the ones already kept. A unit is
+  kept only once for each prefix, by its closest name.
+============================================================================*/
+static void units_suggest_add (SuggestCandidate *candidates, int *n, 
+    int distance, const UnitsPrefix *prefix, const SuggestNode *node)
+  {
+  int i, worst = 0;
+  for (i = 0; i < *n; i++)
     {
-    *pref_pow = test_pow;
-    Unit t = units_find_unit_by_name (name + skip);
-    if ((int)t > 0)
-      return t; 
-    else
+    SuggestCandidate *c = &candidates[i];
+    if (c->node->row == node->row && c->prefix == prefix)
       {
-      *pref_pow = 0;
-      return units_find_unit_by_name (name);
+      if (distance < c->distance)
+        {
+        c->distance = distance;
+        c->node = node;
+        }
+      return;
       }
+    if (c->distance > candidates[worst].distance) worst = i;
+    }
+
+  if (*n < MAX_SUGGEST_CANDIDATES)
+    i = (*n)++;
+  else if (distance < candidates[worst].distance)
+    i = worst;
+  else
+    return;
+  candidates[i].distance = distance;
+  candidates[i].prefix = prefix;
+  candidates[i].node = node;
+  }
+
+
+/*============================================================================
+  units_suggest_search
+  Find the names in the tree within "limit" edits of name, which is in
+  lower case.
+============================================================================*/
+static void units_suggest_search (const char *name, int length, int limit,
+    const UnitsPrefix *prefix, SuggestCandidate *candidates, int *n)
+  {
+  int stack[NAME_INDEX_SIZE], depth = 0;
+
+  if (suggest_tree_size == 0) return;
+  stack[depth++] = 0;
+  while (depth > 0)
+    {
+    const SuggestNode *node = &suggest_tree[stack[--depth]];
+    int d = units_edit_distance (name, length, node->folded, node->length);
+    int child;
+    if (d <= limit)
+      units_suggest_add (candidates, n, d, prefix, node);
+    for (child = node->first_child; child >= 0; 
+        child = suggest_tree[child].next_sibling)
+      if (abs (suggest_tree[child].distance - d) <= limit)
+        stack[depth++] = child;
+    }
+  }
+
+
+/*============================================================================
+  units_suggest_compare
+  Closest first, and then in the order of unit_table, so that the result
+  does not depend on the layout of the tree
+============================================================================*/
+static int units_suggest_compare (const void *a, const void *b)
+  {
+  const SuggestCandidate *ca = a, *cb = b;
+  if (ca->distance != cb->distance) return ca->distance - cb->distance;
+  if (ca->node->row != cb->node->row) return ca->node->row - cb->node->row;
+  if (ca->prefix != cb->prefix) return ca->prefix ? 1 : -1;
+  return ca->node->name - cb->node->name;
+  }
+
+
+/*============================================================================
+  units_suggest
+  Fill candidates with the valid names closest to an unknown one, closest 
+  first, and return how many there are. A name that starts with a prefix 
+  is also compared, without the prefix, with the unit names.
+============================================================================*/
+static int units_suggest (const char *name, SuggestCandidate *candidates)
+  {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  const UnitsPrefix **p;
+  char folded[MAX_UNIT_STRING];
+  int i, n = 0, length = strlen (name);
+
+  units_init ();
+  pthread_once (&once, units_build_suggest_tree);
+
+  if (length > MAX_UNIT_STRING) length = MAX_UNIT_STRING;
+  for (i = 0; i < length; i++)
+    folded[i] = tolower ((unsigned char)name[i]);
+
+  units_suggest_search (folded, length, SUGGEST_DISTANCE_LIMIT (length), 
+    NULL, candidates, &n);
+  // Prefixes are case-sensitive, so are matched before folding
+  for (p = prefix_index[(unsigned char)*name]; *p; p++)
+    {
+    int l = strlen ((*p)->name);
+    if (strncmp (name, (*p)->name, l) == 0)
+      units_suggest_search (folded + l, length - l, 
+        SUGGEST_DISTANCE_LIMIT (length - l), *p, candidates, &n);
+    }
+
+  qsort (candidates, n, sizeof (SuggestCandidate), units_suggest_compare);
+  return n;
+  }
+
+
+/*============================================================================
+  units_suggestion_name
+  Write the name of a suggestion, with its prefix, to s
+============================================================================*/
+static void units_suggestion_name (const SuggestCandidate *c, char *s, 
+    size_t size)
+  {
+  snprintf (s, size, "%s%.*s", c->prefix ? c->prefix->name : "", 
+    c->node->length, c->node->name);
+  }
+
+
+/*============================================================================
+  units_unknown_name_error
+  Write the error for a name that is not found, with the names it might
+  have been meant to be.
+============================================================================*/
+static void units_unknown_name_error (const char *name, 
+    const SuggestCandidate *candidates, int n, char *error, 
+    size_t error_size)
+  {
+  int i, l;
+  l = snprintf (error, error_size, "Unknown unit name: '%s'", name);
+  if (n > MAX_SUGGESTIONS) n = MAX_SUGGESTIONS;
+  for (i = 0; i < n && l < (int)error_size; i++)
+    {
+    char s[MAX_UNIT_STRING * 2];
+    units_suggestion_name (&candidates[i], s, sizeof (s));
+    l += snprintf (error + l, error_size - l, "%s'%s'%s", 
+      i == 0 ? "; did you mean " : i == n - 1 ? " or " : ", ", s,
+      i == n - 1 ? "?" : "");
     }
-  return units_find_unit_by_name (name);
   }
 
 
@@ -562,15 +1048,20 @@ Unit units_find_unit_by_name_and_prefix (const char *name, int *pref_pow,
   unit_parse_single_unit
   (Note -- we have to make special provision for unit names beginning with
   'cu' and 'sq', as these strings are also prefixes for 'cubic' and 'square')
+  Returns FALSE, with a message in error, if s is not a valid unit. If 
+  correction is not NULL, a name that is not found, but is closer to one
+  valid name than to any other, is read as that name, and correction says
+  so; otherwise correction is left alone.
 ============================================================================*/
-void unit_parse_single_unit (const char *s, Unit *unit, int *power, 
-    int *pref_power, char **error)
+BOOL unit_parse_single_unit (const char *s, Unit *unit, int *power, 
+    int *pref_power, char *correction, size_t correction_size, char *error,
+    size_t error_size)
   {
   int i, ii = 0, l = strlen (s);
-  char *ss = malloc (l + 1);
+  char ss[MAX_UNIT_STRING];
 
   // Remove ^
-  for (i = 0; i < l; i++)
+  for (i = 0; i < l && ii < MAX_UNIT_STRING - 1; i++)
     {
     if (s[i] != '^')
       {
@@ -580,7 +1071,6 @@ void unit_parse_single_unit (const char *s, Unit *unit, int *power,
     }
   ss[ii] = 0;
 
-  char temp[100];
   int ab_power = 0;
   int skip = 0;
 
@@ -628,10 +1118,7 @@ void unit_parse_single_unit (const char *s, Unit *unit, int *power,
   *power = ab_power;
 
   if (skip != 0)
-    {
-    strncpy (temp, ss, sizeof (temp) - 1);
-    strcpy (ss, temp + skip);
-    }
+    memmove (ss, ss + skip, strlen (ss + skip) + 1);
 
   int p = -1;
   l = strlen (ss);
@@ -650,22 +1137,26 @@ void unit_parse_single_unit (const char *s, Unit *unit, int *power,
       }
     }
    
-  char sunit[100];
-  char spower[10];
+  char sunit[MAX_UNIT_STRING] = "";
+  char spower[10] = "";
   if (p >= 0)
     {
     if (ab_power == 0)
       {
       strncpy (spower, ss + p, sizeof (spower) - 1);
       ss[p] = 0;
-      strncpy (sunit, ss, sizeof (sunit) - 1);
+      strcpy (sunit, ss);
       }
     else
-      *error = strdup ("Can't use prefix sq, cubic, etc., with an explicit power");
+      {
+      snprintf (error, error_size, 
+        "Can't use prefix sq, cubic, etc., with an explicit power");
+      return FALSE;
+      }
     }
   else
     {
-    strncpy (sunit, ss, sizeof (sunit) - 1);
+    strcpy (sunit, ss);
     strcpy (spower, "1");
     }
 
@@ -673,43 +1164,53 @@ void unit_parse_single_unit (const char *s, Unit *unit, int *power,
     *power = atoi (spower);
   if (*power == 0)
     {
-    char msg[100];
-    snprintf (msg, sizeof (msg), "Bad exponent: '%s'", spower);
-    *error = strdup (msg); 
+    snprintf (error, error_size, "Bad exponent: '%s'", spower);
+    return FALSE;
     }
-  else
+
+  *pref_power = 0;
+  *unit = units_find_unit_by_name_and_prefix (sunit, pref_power, TRUE);
+  if ((int)(*unit) <= 0)
     {
-    *pref_power = 0;
-    *unit = units_find_unit_by_name_and_prefix (sunit, pref_power, TRUE);
-    if ((int)(*unit) <= 0)
+    SuggestCandidate candidates[MAX_SUGGEST_CANDIDATES];
+    int n = units_suggest (sunit, candidates);
+
+    // Correct the name only if no other is as close to it
+    if (correction && n > 0 && 
+        (n == 1 || candidates[1].distance > candidates[0].distance))
       {
-      char msg[140];
-      snprintf (msg, sizeof (msg), "Unknown unit name: '%s'", sunit);
-      *error = strdup (msg); 
+      char s[MAX_UNIT_STRING * 2];
+      units_suggestion_name (&candidates[0], s, sizeof (s));
+      *unit = units_find_unit_by_name_and_prefix (s, pref_power, TRUE);
+      if ((int)(*unit) > 0)
+        {
+        snprintf (correction, correction_size, "'%s' read as '%s'", sunit, 
+          s);
+        return TRUE;
+        }
       }
-    else
-      {
-      // We're done
-      } 
-    }
 
-  //printf ("su=%s, pow=%s\n", sunit, spower);
+    units_unknown_name_error (sunit, candidates, n, error, error_size);
+    return FALSE;
+    }
 
-  free (ss);
+  // We're done
+  return TRUE;
   }
 
 
 /*============================================================================
-  units_parse
+  units_parse_elements
 ============================================================================*/
-Units *units_parse (const char *text, char **error)
+static BOOL units_parse_elements (Units *self, const char *text, 
+    char *correction, size_t correction_size, char *error, size_t error_size)
   {
-  Units *ret = malloc (sizeof (Units));
-  ret->n_elements = 0;
+  self->n_elements = 0;
+  if (correction) correction[0] = 0;
 
   // Check for empty or null string -- this is valid: it's a zero-length unit list
-  if (!text) return ret;
-  if (text[0] == 0) return ret;
+  if (!text) return TRUE;
+  if (text[0] == 0) return TRUE;
 
   int i = 0;
 
@@ -743,48 +1244,93 @@ Units *units_parse (const char *text, char **error)
         }
       }
    
-   char utemp[MAX_UNIT_STRING];
-
-   if (p)
-      {
-      int ulen = p - textp; 
-      if (ulen >= MAX_UNIT_STRING) ulen = MAX_UNIT_STRING - 1; // Should never happen
-      strncpy (utemp, textp, ulen);
-      utemp [ulen] = 0;
-      }
-   else
-      {
-      strcpy (utemp, textp);
-      }
+    char utemp[MAX_UNIT_STRING];
+    size_t ulen = p ? (size_t)(p - textp) : strlen (textp);
+    if (ulen >= MAX_UNIT_STRING) ulen = MAX_UNIT_STRING - 1; // Should never happen
+    memcpy (utemp, textp, ulen);
+    utemp [ulen] = 0;
    
-   // We've got a unit, and div is set if it's a dividing unit ('/sec')
+    // We've got a unit, and div is set if it's a dividing unit ('/sec')
 
-  if (!*error)
-    {
-    // Successful parse of this unit
     Unit unit;
     int power;
     int pref_power;
-    unit_parse_single_unit (utemp, &unit, &power, &pref_power, error);
-    if (!*error)
+    char note[MAX_ERROR_STRING] = "";
+    if (!unit_parse_single_unit (utemp, &unit, &power, &pref_power, 
+        correction ? note : NULL, sizeof (note), error, error_size))
+      {
+      self->n_elements = 0;
+      return FALSE;
+      }
+    if (note[0])
       {
-      ret->units[i].unit = unit;
-      ret->units[i].prefix_power = pref_power;
-      if (div) power = -power;
-      ret->units[i].power = power;
-      i++;
+      size_t l = strlen (correction);
+      snprintf (correction + l, correction_size - l, "%s%s", 
+        l ? ", " : "", note);
       }
-    } 
 
-   div = ndiv;
-   textp = p + 1;
-   } while (found && !*error && (i < MAX_UNIT_ELEMENTS)); 
-   // TODO check MAX_UNIT_ELEMENTS overflow 
+    self->units[i].unit = unit;
+    self->units[i].prefix_power = pref_power;
+    if (div) power = -power;
+    self->units[i].power = power;
+    i++;
+
+    div = ndiv;
+    textp = p + 1;
+    } while (found && (i < MAX_UNIT_ELEMENTS)); 
+
+  if (found)
+    {
+    // There is more text, but no room for the units in it
+    snprintf (error, error_size, "Too many units: no more than %d can be "
+      "combined", MAX_UNIT_ELEMENTS);
+    self->n_elements = 0;
+    return FALSE;
+    }
+
+  self->n_elements = i;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  units_parse_into
+  Parse text into self, which belongs to the caller. Nothing is allocated,
+  whether the parse succeeds or fails. Returns FALSE, with a message of no
+  more than error_size characters in error, if text is not a valid unit.
+============================================================================*/
+BOOL units_parse_into (Units *self, const char *text, char *error, 
+    size_t error_size)
+  {
+  return units_parse_elements (self, text, NULL, 0, error, error_size);
+  }
+
+
+/*============================================================================
+  units_parse_corrected
+  As units_parse_into, but a unit name that is not found is read as the 
+  valid name closest to it, if no other is as close. The corrections made
+  are described in correction, which is empty if there were none.
+============================================================================*/
+BOOL units_parse_corrected (Units *self, const char *text, 
+    char *correction, size_t correction_size, char *error, size_t error_size)
+  {
+  return units_parse_elements (self, text, correction, correction_size, 
+    error, error_size);
+  }
+
 
-  ret->n_elements = i;
+/*============================================================================
+  units_parse
+============================================================================*/
+Units *units_parse (const char *text, char **error)
+  {
+  char message[MAX_ERROR_STRING];
+  Units *ret = malloc (sizeof (Units));
 
-  if (*error)
+  if (!units_parse_into (ret, text, message, sizeof (message)))
     {
+    *error = strdup (message);
     units_free (ret);
     ret = NULL;
     }
@@ -844,31 +1390,278 @@ const char *units_get_name (Unit unit, BOOL plural)
 
 
 /*============================================================================
-  _subdivide and helper macro SUBDIVIDE
+  number formatting
+  Values are formatted without going through printf. For the usual %G-style
+  output, the value is scaled by an exact power of ten in long double 
+  arithmetic and rounded to the required number of significant figures;
+  the single rounding error in the scaling can only affect the result when
+  the value lies almost exactly half way between two candidates, and then
+  -- or when the value is too large or small for the table of exact 
+  powers -- we fall back on snprintf, so the output is always identical
+  to printf's.
 ============================================================================*/
 
-// Macro to abstract boilerplate aspects of _subdivide call.
-#define SUBDIVIDE(n, ...) _subdivide(n, (Unit[]){__VA_ARGS__, 0})
-
-char *_subdivide(double n, Unit* divisions)
+// Powers of ten that long double represents exactly. With a 64-bit 
+//  mantissa, that's up to 10^27; where long double is no wider than 
+//  double, only up to 10^22.
+static const long double powers_of_ten[] = 
   {
-    char s[256];
-    double ratio, whole = 0;
-    size_t length = 0;
+  1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L, 1e11L,
+  1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L,
+#if LDBL_MANT_DIG >= 64
+  1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+#endif
+  };
 
-    if (n < 0)
-      {
-      n = -n;
-      length += 1;
-      strcpy (s, "-");
-      }
+#define N_POWERS_OF_TEN ((int)(sizeof (powers_of_ten) / sizeof (long double)))
 
-    do
-      {
-      if (!*(divisions + 1))
-        {
-        snprintf (s + length, sizeof (s) - length, "%lG %s", n,
-          units_get_name (*divisions, n != 1.0));
+// Precision of the default output format, as for %G
+#define DEFAULT_PRECISION 6
+
+
+/*============================================================================
+  units_round_digits
+  Round x (finite, > 0) to precision significant figures (no more than 17),
+  giving the digits as an integer and the decimal exponent of the first
+  digit. Returns FALSE if the result can't be guaranteed to be correctly
+  rounded.
+============================================================================*/
+static BOOL units_round_digits (double x, int precision, uint64_t *digits,
+    int *exponent)
+  {
+  int binary_exponent;
+  frexp (x, &binary_exponent);
+  // This estimate is never too large, but may be one too small
+  int e = (int) floor ((binary_exponent - 1) * 0.30102999566398120);
+  long double upper = powers_of_ten[precision];
+  long double scaled = 0;
+  int tries;
+
+  for (tries = 0; tries < 2; tries++)
+    {
+    int k = precision - 1 - e;
+    if (k >= N_POWERS_OF_TEN || -k >= N_POWERS_OF_TEN) return FALSE;
+    scaled = k >= 0 ? x * powers_of_ten[k] : x / powers_of_ten[-k];
+    if (scaled < upper) break;
+    e++;
+    }
+
+  long double whole = floorl (scaled);
+  long double fraction = scaled - whole;
+  if (fabsl (fraction - 0.5L) <= scaled * LDBL_EPSILON) return FALSE;
+
+  uint64_t r = (uint64_t) whole + (fraction > 0.5L);
+  if (r == (uint64_t) upper)
+    {
+    r /= 10;
+    e++;
+    }
+  *digits = r;
+  *exponent = e;
+  return TRUE;
+  }
+
+
+/*============================================================================
+  units_format_g
+  Format n like printf's "%.*G", into s, which must have room for
+  MAX_NUMBER_STRING characters. Returns the length.
+============================================================================*/
+static int units_format_g (char *s, double n, int precision)
+  {
+  char *p = s;
+  char digits[20];
+  uint64_t r;
+  int e, i, nd;
+
+  if (isnan (n) || isinf (n) || n == 0)
+    return snprintf (s, MAX_NUMBER_STRING, "%.*G", precision, n);
+
+  if (n < 0)
+    {
+    *p++ = '-';
+    n = -n;
+    }
+
+  if (!units_round_digits (n, precision, &r, &e))
+    return (p - s) + snprintf (p, MAX_NUMBER_STRING - (p - s), "%.*G", 
+      precision, n);
+
+  for (i = precision - 1; i >= 0; i--)
+    {
+    digits[i] = '0' + r % 10;
+    r /= 10;
+    }
+
+  // %G drops trailing zeros
+  nd = precision;
+  while (nd > 1 && digits[nd - 1] == '0') nd--;
+
+  if (e < -4 || e >= precision)
+    {
+    *p++ = digits[0];
+    if (nd > 1)
+      {
+      *p++ = '.';
+      memcpy (p, digits + 1, nd - 1);
+      p += nd - 1;
+      }
+    *p++ = 'E';
+    *p++ = e < 0 ? '-' : '+';
+    if (e < 0) e = -e;
+    if (e >= 100) *p++ = '0' + e / 100;
+    *p++ = '0' + (e / 10) % 10;
+    *p++ = '0' + e % 10;
+    }
+  else if (e >= 0)
+    {
+    for (i = 0; i <= e; i++)
+      *p++ = i < nd ? digits[i] : '0';
+    if (nd > e + 1)
+      {
+      *p++ = '.';
+      memcpy (p, digits + e + 1, nd - e - 1);
+      p += nd - e - 1;
+      }
+    }
+  else
+    {
+    *p++ = '0';
+    *p++ = '.';
+    for (i = 0; i < -e - 1; i++) *p++ = '0';
+    memcpy (p, digits, nd);
+    p += nd;
+    }
+
+  *p = 0;
+  return p - s;
+  }
+
+
+/*============================================================================
+  units_format_shortest
+  Format n with the fewest significant figures that read back as exactly
+  the same value
+============================================================================*/
+static int units_format_shortest (char *s, double n)
+  {
+  int precision;
+  if (isnan (n) || isinf (n)) return units_format_g (s, n, 17);
+
+  // Whole numbers below 10^15 need no more than 15 digits, and that's all
+  //  "%.15G" will give them
+  if (fabs (n) < 1e15 && n == (double)(int64_t) n) 
+    return units_format_g (s, n, 15);
+
+  // Any value with a round-trip representation of 15 or fewer digits
+  //  gets it from "%.15G", because 15-digit decimals are spaced more widely
+  //  than doubles. That isn't so for subnormal values, which have fewer
+  //  significant bits, so for those we have to try every precision.
+  precision = fabs (n) < DBL_MIN ? 1 : 15;
+  for (; precision < 17; precision++)
+    {
+    int length = units_format_g (s, n, precision);
+    if (strtod (s, NULL) == n) return length;
+    }
+  return units_format_g (s, n, 17);
+  }
+
+
+/*============================================================================
+  units_format_number
+  Format n into s, which has room for size characters, in the given format.
+  Returns the length of the result (truncated, if s is too small).
+============================================================================*/
+int units_format_number (char *s, size_t size, double n, 
+    UnitsNumberFormat format)
+  {
+  char temp[MAX_NUMBER_STRING];
+  char *p = size >= MAX_NUMBER_STRING ? s : temp;
+  int length;
+
+  if (size == 0) return 0;
+  if (format == units_format_roundtrip)
+    length = units_format_shortest (p, n);
+  else
+    length = units_format_g (p, n, DEFAULT_PRECISION);
+
+  if (p == temp)
+    {
+    if (length >= (int)size) length = size - 1;
+    memcpy (s, temp, length);
+    s[length] = 0;
+    }
+  return length;
+  }
+
+
+/*============================================================================
+  units_append
+  Append text to s, which has room for size characters and already holds
+  length. Returns the new length, which is never more than size - 1.
+============================================================================*/
+static size_t units_append (char *s, size_t size, size_t length, 
+    const char *text)
+  {
+  size_t l = strlen (text);
+  if (length + l >= size) l = size - 1 - length;
+  memcpy (s + length, text, l);
+  length += l;
+  s[length] = 0;
+  return length;
+  }
+
+
+/*============================================================================
+  units_append_int
+============================================================================*/
+static size_t units_append_int (char *s, size_t size, size_t length, int n)
+  {
+  char temp[16];
+  char *p = temp + sizeof (temp);
+  unsigned int u = n < 0 ? -(unsigned int)n : (unsigned int)n;
+  *--p = 0;
+  do
+    {
+    *--p = '0' + u % 10;
+    u /= 10;
+    } while (u);
+  if (n < 0) *--p = '-';
+  return units_append (s, size, length, p);
+  }
+
+
+/*============================================================================
+  _subdivide and helper macro SUBDIVIDE
+============================================================================*/
+
+// Macro to abstract boilerplate aspects of _subdivide call. It writes into
+//  the buffer s, of the given size, in the number format "format", all of 
+//  which must be in scope.
+#define SUBDIVIDE(n, ...) _subdivide(s, size, n, format, \
+  (Unit[]){__VA_ARGS__, 0})
+
+static int _subdivide (char *s, size_t size, double n, 
+    UnitsNumberFormat format, const Unit *divisions)
+  {
+    double ratio, whole = 0;
+    size_t length = 0;
+
+    s[0] = 0;
+    if (n < 0)
+      {
+      n = -n;
+      length = units_append (s, size, length, "-");
+      }
+
+    do
+      {
+      if (!*(divisions + 1))
+        {
+        length += units_format_number (s + length, size - length, n, format);
+        length = units_append (s, size, length, " ");
+        length = units_append (s, size, length, 
+          units_get_name (*divisions, n != 1.0));
         break;
         }
 
@@ -881,11 +1674,14 @@ char *_subdivide(double n, Unit* divisions)
       );
 
       n = modf (n, &whole) * ratio;
-      length += snprintf (s + length, sizeof (s) - length, n ? "%d %s, " : "%d %s",
-        (int) whole, units_get_name (*divisions++, whole != 1.0));
+      length = units_append_int (s, size, length, (int) whole);
+      length = units_append (s, size, length, " ");
+      length = units_append (s, size, length, 
+        units_get_name (*divisions++, whole != 1.0));
+      if (n) length = units_append (s, size, length, ", ");
      } while (n);
 
-    return strdup (s);
+    return length;
   }
 
 
@@ -946,209 +1742,103 @@ void units_free (Units *self)
 
 
 /*============================================================================
-  units_compare_units
-  Compare units, possibly accepting inverse units (km/h and h/km)
+  units_temperature_zero
+  The value, in degrees Rankine, of zero on the given temperature scale.
+  Together with the slopes in conv_table, which are in Rankine degrees,
+  this lets any temperature conversion be written as n * factor + offset
 ============================================================================*/
-BOOL units_compare_units (const Units *u1, const Units *u2, BOOL allow_inverse,
-     BOOL *inverse)
+static double units_temperature_zero (Unit unit)
   {
-  if (u1->n_elements != u2->n_elements) return FALSE;
-  
-  int i, j, l = u1->n_elements;
-
-  BOOL seems_equal = FALSE;
-  BOOL seems_inverse = FALSE;
-
-  for (i = 0; i < l; i++)
+  switch (unit)
     {
-    BOOL found_equal = TRUE;
-    BOOL found_inverse = TRUE;
-
-    Unit try_unit = u1->units[i].unit;
-    int try_power = u1->units[i].power;
-    BOOL found = FALSE;
-    for (j = 0; j < l && !found; j++)
-      {
-      Unit unit = u2->units[j].unit;
-      int power = u2->units[j].power;
-      if (unit == try_unit)
-        { 
-        if (power == try_power)
-          {
-          found_equal = TRUE;
-          found_inverse = FALSE;
-          found = TRUE;
-          }
-        else if (power == -try_power)
-          {
-          found_equal = FALSE;
-          found_inverse = TRUE;
-          found = TRUE;
-          }
-        else
-          {
-          found = FALSE;
-          found_equal = FALSE;
-          found_inverse = FALSE;
-          }
-        }
-      else
-        {
-        found_equal = FALSE;
-        found_inverse = FALSE;
-        }
-      }
-    if (found_equal)
-      {
-      if (seems_inverse) return FALSE;
-      seems_equal = TRUE; 
-      }
-    else if (found_inverse)
-      {
-      if (seems_equal) return FALSE;
-      seems_inverse = TRUE; 
-      }
-    else
-      return FALSE;
-    }
-  if (seems_equal) 
-    {
-    return TRUE;
-    }
-  if (seems_inverse) 
-    {
-    if (allow_inverse)
-      {
-      *inverse = TRUE;
-      return TRUE;
-      }
+    case celsius: return 491.67;
+    case fahrenheit: return 459.67;
+    default: return 0;
     }
-  return FALSE;
   }
 
 
 /*============================================================================
-  units_convert_temp
+  Scales
+  The factor for a unit with a prefix, raised to a power, is worked out
+  without pow() for the prefixes and powers that are used in practice.
 ============================================================================*/
-double units_convert_temp (double n, Unit from, Unit to) 
-  {
-  if (from == to)
-    return n;
-
-  if (from == celsius && to == fahrenheit)
-    return n * 1.8 + 32;
-  if (from == celsius && to == kelvin)
-    return n + 273.15;
-  if (from == celsius && to == rankine)
-    return n * 1.8 + 491.67;
 
-  if (from == kelvin && to == fahrenheit)
-    return (n - 273.15) * 1.8 + 32;
-  if (from == kelvin && to == celsius)
-    return n - 273.15;
-  if (from == kelvin && to == rankine)
-    return n * 1.8;
+// Powers of ten for prefixes from 10^-30 to 10^30
+#define MIN_PREFIX_POWER -30
+#define MAX_PREFIX_POWER 30
 
-  if (from == fahrenheit && to == celsius)
-    return (n - 32) * 5.0/9.0;
-  if (from == fahrenheit && to == kelvin)
-    return (n - 32) * 5.0/9.0 + 273.15;
-  if (from == fahrenheit && to == rankine)
-    return n + 459.67;
+static const double prefix_scales[] =
+  {
+  1e-30, 1e-29, 1e-28, 1e-27, 1e-26, 1e-25, 1e-24, 1e-23, 1e-22, 1e-21,
+  1e-20, 1e-19, 1e-18, 1e-17, 1e-16, 1e-15, 1e-14, 1e-13, 1e-12, 1e-11,
+  1e-10, 1e-9, 1e-8, 1e-7, 1e-6, 1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1,
+  1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+  1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22, 1e23, 1e24, 1e25, 1e26,
+  1e27, 1e28, 1e29, 1e30
+  };
 
-  if (from == rankine && to == fahrenheit)
-    return n - 459.67;
-  if (from == rankine && to == kelvin)
-    return n * 5.0/9.0;
-  if (from == rankine && to == celsius)
-    return (n - 491.67) * 5.0/9.0;
-
-  return 0; // We should never get here
-  }
+// Powers up to this are worked out by repeated multiplication
+#define MAX_REPEATED_POWER 8
 
 
 /*============================================================================
-  units_insert_element
+  units_prefix_scale
+  10 to the power of the prefix
 ============================================================================*/
-void units_insert_element (Units *units, Unit u, int power)
+static inline double units_prefix_scale (int prefix_power)
   {
-  int i, l = units->n_elements;
-  for (i = 0; i < l; i++)
-    {
-    if (units->units[i].unit == u)
-      {
-      // Unit already in set. Modify power
-      units->units[i].power += power;
-
-      // As a result of the insertion, we might have some elements with zero
-      //  power. We must remove these, or it will mess up the unit comparison
-      //  later
-
-      Units temp_units;
-      memset (&temp_units, 0, sizeof (temp_units));
-      l = units->n_elements;
-      for (i = 0; i < l; i++)
-        {
-        if (units->units[i].power != 0)
-          {
-          memcpy (&(temp_units.units[temp_units.n_elements]), &(units->units[i]),
-             sizeof (UnitAndPower));
-          temp_units.n_elements++;
-          }
-        }
-      memcpy (units, &temp_units, sizeof (Units)); 
-      return;
-      }
-    }
-
-  if (units->n_elements == MAX_UNIT_ELEMENTS)
-    {
-    // This should never happen in normal operation; but we need to
-    //  report it if it does
-    fprintf (stderr, "Too many unit elements in units_insert_elements\n");
-    exit (0);
-    }
-  
-  // Unit does not exist -- add it
-  units->units[l].unit = u;
-  units->units[l].power = power;
-  units->units[l].prefix_power = 0;
-  units->n_elements++;
+  if (prefix_power >= MIN_PREFIX_POWER && prefix_power <= MAX_PREFIX_POWER)
+    return prefix_scales[prefix_power - MIN_PREFIX_POWER];
+  return pow (10, prefix_power);
   }
 
+
 /*============================================================================
-  units_insert_elements
+  units_scale_power
+  x to the power n. For small n, this is done by multiplication in long
+  double, which is rounded only once at the end, and so is within an ulp 
+  of what pow() gives.
 ============================================================================*/
-void units_insert_elements (Units *units, const Units *u, int power)
+static inline double units_scale_power (double x, int n)
   {
-  int i, l = u->n_elements;
-  for (i = 0; i < l; i++)
-    {
-    units_insert_element (units, u->units[i].unit, u->units[i].power * power);
-    } 
+  int i, m = n < 0 ? -n : n;
+  if (n == 1) return x;
+  if (m > MAX_REPEATED_POWER) return pow (x, n);
+
+  long double r = 1;
+  for (i = 0; i < m; i++)
+    r *= x;
+  return n < 0 ? (double)(1 / r) : (double)r;
   }
 
 
 /*============================================================================
-  units_convert
+  units_reduce_to_base_units
+  Work out the dimensions of the units, and the factor that converts them
+  to the base units.
 ============================================================================*/
 double units_reduce_to_base_units (const Units *from_units, 
-    Units *from_base_units, char **error)
+    UnitsDimension *dimension, char **error)
   {
   double r = 1;
-  from_base_units->n_elements = 0;
-  int i, l = from_units->n_elements;
+  int i, k, l = from_units->n_elements;
   BOOL is_rate = FALSE, has_temperature = FALSE;
+
+  units_init ();
+  memset (dimension, 0, sizeof (*dimension));
   for (i = 0; i < l && !*error; i++)
     {
     int index = units_find_conv_table_index (from_units->units[i].unit, 1);
     if (index >= 0)
       {
-      Units *base_units = &(conv_table[index].base_unit);
-      r = r * pow (conv_table[index].slope * 
-         pow (10, from_units->units[i].prefix_power), 
-           from_units->units[i].power);
-      units_insert_elements (from_base_units, base_units, from_units->units[i].power);
+      int power = from_units->units[i].power;
+
+      r = r * units_scale_power (conv_table[index].slope * 
+         units_prefix_scale (from_units->units[i].prefix_power), power);
+      // No power in conv_table is large, so this can't overflow
+      for (k = 0; k < N_BASE_UNITS; k++)
+        dimension->powers[k] += (int64_t)conv_powers[index][k] * power;
 
       if (from_units->units[i].power < 0)
         is_rate = TRUE;
@@ -1170,6 +1860,8 @@ double units_reduce_to_base_units (const Units *from_units,
       }      
     }
 
+  units_pack_dimension (dimension);
+
   if (has_temperature && !is_rate)
     {
     *error = strdup
@@ -1182,89 +1874,273 @@ double units_reduce_to_base_units (const Units *from_units,
 
 
 /*============================================================================
-  temperature_unit
+  units_absolute_temperature
+  A single temperature, not raised to any power, is a point on its scale
+  rather than a difference, and must be converted with the scale's zero
 ============================================================================*/
-BOOL temperature_unit (const Units *u)
+static BOOL units_absolute_temperature (const Units *u)
   {
-    switch (u->units[0].unit)
-      {
-      case celsius:
-      case fahrenheit:
-      case kelvin:
-      case rankine:
-        return u->n_elements == 1;
-      default:
-        return FALSE;
-      }
+  if (u->n_elements != 1 || u->units[0].power != 1) return FALSE;
+  switch (u->units[0].unit)
+    {
+    case celsius:
+    case fahrenheit:
+    case kelvin:
+    case rankine:
+      return TRUE;
+    default:
+      return FALSE;
+    }
   }
 
 
 /*============================================================================
-  units_convert
+  units_plan_init
+  Work out, once, how to convert values in from_units to to_units. Returns
+  FALSE and sets *error if the units can't be converted.
 ============================================================================*/
-double units_convert (double n, const Units *from_units, 
+BOOL units_plan_init (UnitsPlan *self, const Units *from_units, 
     const Units *to_units, char **error)
   {
-  // Check for temperature conversion, which is a special case
-  if (temperature_unit (from_units) && temperature_unit (to_units))
-    return units_convert_temp (n, from_units->units[0].unit, to_units->units[0].unit);
+  UnitsDimension from_dimension;
+  double from_factor = units_reduce_to_base_units (from_units, 
+    &from_dimension, error);
+  if (*error) return FALSE;
 
-  // Not temperature. Check general cases
-
-  Units from_base_units;
-  double from_factor = units_reduce_to_base_units (from_units, &from_base_units, 
+  UnitsDimension to_dimension;
+  double to_factor = units_reduce_to_base_units (to_units, &to_dimension, 
     error);
-  if (!*error)
+  if (*error) return FALSE;
+
+  // Units are inverse if their dimensions are, as km/h and h/km are
+  BOOL inverse = !units_compare_dimensions (&from_dimension, &to_dimension,
+    1);
+  if (inverse && !units_compare_dimensions (&from_dimension, &to_dimension, 
+      -1))
+    {
+    char s[256];
+    char *ss1 = units_format_string (from_units, FALSE); 
+    char *ss2 = units_format_string (to_units, FALSE); 
+    snprintf (s, sizeof (s), 
+      "Can't convert %s to %s,\nbecause their base dimensions are different", 
+     ss1, ss2);
+    free (ss1);
+    free (ss2);
+    *error = strdup (s); 
+    return FALSE;
+    }
+
+  self->inverse = inverse;
+  self->offset = -0.0;
+  if (inverse)
+    self->factor = from_factor * to_factor;
+  else
     {
-    Units to_base_units;
-    double to_factor = units_reduce_to_base_units (to_units, &to_base_units, 
-      error);
-    if (!*error)
+    self->factor = from_factor / to_factor;
+    // Temperatures in degrees Rankine are n * from_factor + the zero of the
+    //  from scale, which is then less the zero of the to scale, over 
+    //  to_factor
+    if (units_absolute_temperature (from_units) && 
+        units_absolute_temperature (to_units))
       {
-      BOOL inverse = FALSE;
-      if (units_compare_units (&from_base_units, &to_base_units, TRUE, &inverse))
-        {
-        if (inverse)
-          {
-          double factor = from_factor*to_factor;
-          double res = n * factor;
-          return 1.0/res;
-          }
-        else 
-          {
-          double factor = from_factor/to_factor;
-          double res = n * factor;
-          return res;
-          }
-        }
-      else
-        {
-        char s[256];
-        char *ss1 = units_format_string (from_units, FALSE); 
-        char *ss2 = units_format_string (to_units, FALSE); 
-        snprintf (s, sizeof (s), 
-          "Can't convert %s to %s,\nbecause their base dimensions are different", 
-         ss1, ss2);
-        free (ss1);
-        free (ss2);
-        //units_dump (&from_base_units);
-        //units_dump (&to_base_units);
-        *error = strdup (s); 
-        }
+      double zero = units_temperature_zero (from_units->units[0].unit) - 
+        units_temperature_zero (to_units->units[0].unit);
+      if (zero != 0) self->offset = zero / to_factor;
       }
     }
+  return TRUE;
+  }
+
 
-  return 0; // Get here only on error
+/*============================================================================
+  units_plan_create
+============================================================================*/
+UnitsPlan *units_plan_create (const Units *from_units, const Units *to_units,
+    char **error)
+  {
+  UnitsPlan *ret = malloc (sizeof (UnitsPlan));
+  if (!units_plan_init (ret, from_units, to_units, error))
+    {
+    free (ret);
+    ret = NULL;
+    }
+  return ret;
   }
 
 
 /*============================================================================
-  units_format_string
-  plural = render the plural form of the name, if there is one
+  units_plan_free
 ============================================================================*/
-char *units_format_string (const Units *self, BOOL plural)
+void units_plan_free (UnitsPlan *self)
+  {
+  if (self)
+    {
+    free (self);
+    }
+  }
+
+
+/*============================================================================
+  units_plan_apply
+============================================================================*/
+double units_plan_apply (const UnitsPlan *self, double n)
+  {
+  if (self->inverse)
+    return 1.0 / (n * self->factor);
+  return n * self->factor + self->offset;
+  }
+
+
+/*============================================================================
+  units_convert_array_scalar
+============================================================================*/
+static void units_convert_array_scalar (const double *in, double *out, 
+    size_t n, const UnitsPlan *plan)
+  {
+  size_t i;
+  double factor = plan->factor, offset = plan->offset;
+  if (plan->inverse)
+    for (i = 0; i < n; i++) out[i] = 1.0 / (in[i] * factor);
+  else
+    for (i = 0; i < n; i++) out[i] = in[i] * factor + offset;
+  }
+
+
+#ifdef UNITS_X86_DISPATCH
+
+/*============================================================================
+  units_convert_array_sse2
+============================================================================*/
+__attribute__((target("sse2")))
+static void units_convert_array_sse2 (const double *in, double *out, 
+    size_t n, const UnitsPlan *plan)
+  {
+  size_t i = 0;
+  __m128d factor = _mm_set1_pd (plan->factor);
+  __m128d offset = _mm_set1_pd (plan->offset);
+  __m128d one = _mm_set1_pd (1.0);
+  if (plan->inverse)
+    for (; i + 2 <= n; i += 2)
+      _mm_storeu_pd (out + i, 
+        _mm_div_pd (one, _mm_mul_pd (_mm_loadu_pd (in + i), factor)));
+  else
+    for (; i + 2 <= n; i += 2)
+      _mm_storeu_pd (out + i, 
+        _mm_add_pd (_mm_mul_pd (_mm_loadu_pd (in + i), factor), offset));
+  units_convert_array_scalar (in + i, out + i, n - i, plan);
+  }
+
+
+/*============================================================================
+  units_convert_array_avx2
+============================================================================*/
+__attribute__((target("avx2")))
+static void units_convert_array_avx2 (const double *in, double *out, 
+    size_t n, const UnitsPlan *plan)
+  {
+  size_t i = 0;
+  __m256d factor = _mm256_set1_pd (plan->factor);
+  __m256d offset = _mm256_set1_pd (plan->offset);
+  __m256d one = _mm256_set1_pd (1.0);
+  if (plan->inverse)
+    for (; i + 4 <= n; i += 4)
+      _mm256_storeu_pd (out + i, 
+        _mm256_div_pd (one, _mm256_mul_pd (_mm256_loadu_pd (in + i), factor)));
+  else
+    for (; i + 4 <= n; i += 4)
+      _mm256_storeu_pd (out + i, 
+        _mm256_add_pd (_mm256_mul_pd (_mm256_loadu_pd (in + i), factor), 
+          offset));
+  units_convert_array_scalar (in + i, out + i, n - i, plan);
+  }
+
+
+/*============================================================================
+  units_convert_array_avx512
+============================================================================*/
+__attribute__((target("avx512f")))
+static void units_convert_array_avx512 (const double *in, double *out, 
+    size_t n, const UnitsPlan *plan)
+  {
+  size_t i = 0;
+  __m512d factor = _mm512_set1_pd (plan->factor);
+  __m512d offset = _mm512_set1_pd (plan->offset);
+  __m512d one = _mm512_set1_pd (1.0);
+  if (plan->inverse)
+    for (; i + 8 <= n; i += 8)
+      _mm512_storeu_pd (out + i, 
+        _mm512_div_pd (one, _mm512_mul_pd (_mm512_loadu_pd (in + i), factor)));
+  else
+    for (; i + 8 <= n; i += 8)
+      _mm512_storeu_pd (out + i, 
+        _mm512_add_pd (_mm512_mul_pd (_mm512_loadu_pd (in + i), factor), 
+          offset));
+  units_convert_array_scalar (in + i, out + i, n - i, plan);
+  }
+
+#endif // UNITS_X86_DISPATCH
+
+
+typedef void (*UnitsArrayKernel) (const double *in, double *out, size_t n,
+  const UnitsPlan *plan);
+
+static UnitsArrayKernel array_kernel = units_convert_array_scalar;
+
+/*============================================================================
+  units_select_array_kernel
+  Choose the widest vector implementation the CPU we're running on 
+  supports
+============================================================================*/
+static void units_select_array_kernel (void)
+  {
+#ifdef UNITS_X86_DISPATCH
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx512f")) 
+    array_kernel = units_convert_array_avx512;
+  else if (__builtin_cpu_supports ("avx2")) 
+    array_kernel = units_convert_array_avx2;
+  else if (__builtin_cpu_supports ("sse2")) 
+    array_kernel = units_convert_array_sse2;
+#endif
+  }
+
+
+/*============================================================================
+  units_convert_array
+  Apply a plan to n values at once. in and out may be the same array. The
+  results are exactly those of units_plan_apply.
+============================================================================*/
+void units_convert_array (const double *in, double *out, size_t n, 
+    const UnitsPlan *plan)
+  {
+  units_init ();
+  array_kernel (in, out, n, plan);
+  }
+
+
+/*============================================================================
+  units_convert
+  Convenience function for a single conversion. Where many values are to be
+  converted between the same units, create a plan and apply it to each.
+============================================================================*/
+double units_convert (double n, const Units *from_units, 
+    const Units *to_units, char **error)
+  {
+  UnitsPlan plan;
+  if (!units_plan_init (&plan, from_units, to_units, error))
+    return 0; // Get here only on error
+  return units_plan_apply (&plan, n);
+  }
+
+
+/*============================================================================
+  units_format_units
+  Write the names of the units into s. plural = render the plural form of 
+  the name, if there is one
+============================================================================*/
+static void units_format_units (const Units *self, BOOL plural, 
+    char s[MAX_FORMATTED_UNITS])
   {
-  char s[256];
   s[0] = 0;
 
   int i, last_numerator = -1, l = self->n_elements;
@@ -1327,15 +2203,28 @@ char *units_format_string (const Units *self, BOOL plural)
         sprintf (s + strlen (s), "^%d", power); // TODO 
       }
     }
-  char *ret = strdup (s);
-  return ret;
   }
 
+
 /*============================================================================
-  units_format_string_and_value
+  units_format_string
+  plural = render the plural form of the name, if there is one
 ============================================================================*/
-char *units_format_string_and_value (const Units *self, double n, 
-    BOOL force_decimal)
+char *units_format_string (const Units *self, BOOL plural)
+  {
+  char s[MAX_FORMATTED_UNITS];
+  units_format_units (self, plural, s);
+  return strdup (s);
+  }
+
+/*============================================================================
+  units_format_value
+  Format a value and its units into s, which has room for size characters,
+  and return the length. Unless force_decimal is set, values in units that
+  have non-decimal subdivisions are split into them (1 foot, 6 inches).
+============================================================================*/
+int units_format_value (char *s, size_t size, const Units *self, double n,
+    BOOL force_decimal, UnitsNumberFormat format)
   {
   if (!force_decimal && self->n_elements == 1 && self->units[0].power == 1 &&
       self->units[0].prefix_power == 0)
@@ -1396,14 +2285,221 @@ char *units_format_string_and_value (const Units *self, double n,
     }
 
 
-  char s[256];
-  char *s_unit = units_format_string (self, n != 1.000);
-#ifdef WIN32
-  sprintf (s, "%lG %s", n, s_unit);
-#else
-  snprintf (s, sizeof (s), "%lG %s", n, s_unit);
-#endif
-  free (s_unit);
+  char s_unit[MAX_FORMATTED_UNITS];
+  units_format_units (self, n != 1.000, s_unit);
+  size_t length = units_format_number (s, size, n, format);
+  length = units_append (s, size, length, " ");
+  return units_append (s, size, length, s_unit);
+  }
+
+
+/*============================================================================
+  Human-readable scales
+  units_humanize chooses the prefix, or the multiple of a byte or bit, 
+  that gives a value from 1 up to 1000 (or 1024). The scale comes from the
+  binary exponent of the value, which is read from its bits, not computed,
+  and how a unit can be scaled is looked up in a table indexed by unit; so
+  no logarithms are taken, no tables searched, and no trial conversions 
+  made.
+============================================================================*/
+
+// The multiples of bytes and bits, SI and IEC, in steps of 1000 or 1024
+#define N_DATA_SCALES 7
+
+static const Unit data_scales[][N_DATA_SCALES] = 
+  {
+  { byte, kilobyte, megabyte, gigabyte, terabyte, petabyte, exabyte },
+  { byte, kibibyte, mebibyte, gibibyte, tebibyte, pebibyte, exbibyte },
+  { bit, kilobit, megabit, gigabit, terabit, petabit, exabit },
+  { bit, kibibit, mebibit, gibibit, tebibit, pebibit, exbibit },
+  };
+
+// The units that are given SI prefixes, and the largest prefix for each.
+//  The prefixes used are the powers of 1000, from quecto to quetta
+typedef struct _UnitsHumanScale
+  {
+  Unit unit;
+  int max_prefix_power;
+  } UnitsHumanScale;
+
+static const UnitsHumanScale human_scales[] = 
+  {
+  { meter, MAX_PREFIX_POWER }, { second, 0 }, { litre, MAX_PREFIX_POWER },
+  { gramme, 3 }, { newton, MAX_PREFIX_POWER }, { pascal, MAX_PREFIX_POWER },
+  { joule, MAX_PREFIX_POWER }, { watt, MAX_PREFIX_POWER }, 
+  { electron_volt, MAX_PREFIX_POWER }, { ampere, MAX_PREFIX_POWER }, 
+  { coulomb, MAX_PREFIX_POWER }, { kelvin, MAX_PREFIX_POWER }, 
+  { becquerel, MAX_PREFIX_POWER }, { gray, MAX_PREFIX_POWER }, 
+  { sievert, MAX_PREFIX_POWER }, { radian, 0 }, { candela, MAX_PREFIX_POWER },
+  { lumen, MAX_PREFIX_POWER }, { lux, MAX_PREFIX_POWER },
+  { 0, 0 }
+  };
+
+// How each unit is scaled, indexed by Unit
+#define MAX_HUMAN_UNIT 256
+_Static_assert (light_week < MAX_HUMAN_UNIT, "MAX_HUMAN_UNIT is too small");
+
+typedef enum { human_none = 0, human_data, human_prefix } UnitsHumanKind;
+
+typedef struct _UnitsHumanIndex
+  {
+  UnitsHumanKind kind;
+  int row;               // human_data: the row and column of data_scales
+  int scale;
+  int max_prefix_power;  // human_prefix
+  } UnitsHumanIndex;
+
+static UnitsHumanIndex human_index [MAX_HUMAN_UNIT];
+
+
+/*============================================================================
+  units_build_human_index
+============================================================================*/
+static void units_build_human_index (void)
+  {
+  const UnitsHumanScale *h;
+  int row, scale;
+
+  // Later rows don't replace byte and bit, which are in the SI and IEC
+  //  rows alike; units_humanize chooses between them
+  for (row = (int)(sizeof (data_scales) / sizeof (data_scales[0])) - 1; 
+      row >= 0; row--)
+    for (scale = 0; scale < N_DATA_SCALES; scale++)
+      {
+      UnitsHumanIndex *index = &human_index[data_scales[row][scale]];
+      index->kind = human_data;
+      index->row = row;
+      index->scale = scale;
+      }
+
+  for (h = human_scales; h->unit; h++)
+    {
+    human_index[h->unit].kind = human_prefix;
+    human_index[h->unit].max_prefix_power = h->max_prefix_power;
+    }
+  }
+
+
+/*============================================================================
+  units_binary_exponent
+  floor (log2 |x|), for finite, non-zero x
+============================================================================*/
+static inline int units_binary_exponent (double x)
+  {
+  uint64_t bits;
+  memcpy (&bits, &x, sizeof (bits));
+  int e = (int)(bits >> 52 & 0x7ff);
+  return e == 0 ? ilogb (x) : e - 1023;
+  }
+
+
+/*============================================================================
+  units_decimal_exponent
+  floor (log10 |x|), or one less, for finite, non-zero x: 1233/4096 is 
+  just under log10 2
+============================================================================*/
+static inline int units_decimal_exponent (double x)
+  {
+  int e = units_binary_exponent (x) * 1233;
+  return e >= 0 ? e / 4096 : -((-e + 4095) / 4096);
+  }
+
+
+/*============================================================================
+  units_humanize_data
+  Rescale a value in the unit at "scale" of a row of data_scales. 
+============================================================================*/
+static double units_humanize_data (Units *self, double n, int row, 
+    int scale)
+  {
+  BOOL iec = row % 2 == 1;
+  int e, best;
+
+  // To bytes or bits, and then to the largest multiple not above the value
+  if (iec)
+    {
+    n = ldexp (n, 10 * scale);
+    e = units_binary_exponent (n);
+    best = e < 0 ? 0 : e / 10;
+    }
+  else
+    {
+    n = n * units_prefix_scale (3 * scale);
+    e = units_decimal_exponent (n);
+    best = e < 0 ? 0 : e / 3;
+    if (best < N_DATA_SCALES - 1 && 
+        fabs (n) >= units_prefix_scale (3 * best + 3)) 
+      best++;
+    }
+  if (best > N_DATA_SCALES - 1) best = N_DATA_SCALES - 1;
+
+  self->units[0].unit = data_scales[row][best];
+  return iec ? ldexp (n, -10 * best) : n / units_prefix_scale (3 * best);
+  }
+
+
+/*============================================================================
+  units_humanize_prefix
+  Rescale a value in a unit that takes SI prefixes.
+============================================================================*/
+static double units_humanize_prefix (Units *self, double n, 
+    int max_prefix_power)
+  {
+  int e, power;
+
+  n = n * units_prefix_scale (self->units[0].prefix_power);
+  e = units_decimal_exponent (n);
+  power = e >= 0 ? e / 3 * 3 : -((-e + 2) / 3 * 3);
+  if (fabs (n) >= units_prefix_scale (power + 3)) power += 3;
+
+  if (power > max_prefix_power) power = max_prefix_power;
+  if (power < MIN_PREFIX_POWER) power = MIN_PREFIX_POWER;
+  self->units[0].prefix_power = power;
+  return n / units_prefix_scale (power);
+  }
+
+
+/*============================================================================
+  units_humanize
+  Change units of a single unit, not raised to any power, to the SI 
+  prefix, or the multiple of a byte or bit, that best suits the value n,
+  and return n in the new units. Bytes and bits keep to their SI or IEC 
+  multiples, as the units already are; plain bytes and bits take IEC
+  multiples if "iec" is set. Other units, or values that are zero or not
+  finite, are left as they are.
+============================================================================*/
+double units_humanize (Units *self, double n, BOOL iec)
+  {
+  units_init ();
+  if (self->n_elements != 1 || self->units[0].power != 1 || n == 0 || 
+      !isfinite (n) || (unsigned)self->units[0].unit >= MAX_HUMAN_UNIT)
+    return n;
+
+  const UnitsHumanIndex *index = &human_index[self->units[0].unit];
+  switch (index->kind)
+    {
+    case human_data:
+      if (self->units[0].prefix_power != 0) return n;
+      return units_humanize_data (self, n, 
+        index->scale == 0 && iec ? index->row + 1 : index->row, 
+        index->scale);
+    case human_prefix:
+      return units_humanize_prefix (self, n, index->max_prefix_power);
+    default:
+      return n;
+    }
+  }
+
+
+/*============================================================================
+  units_format_string_and_value
+============================================================================*/
+char *units_format_string_and_value (const Units *self, double n, 
+    BOOL force_decimal)
+  {
+  char s[MAX_FORMATTED_UNITS];
+  units_format_value (s, sizeof (s), self, n, force_decimal, 
+    units_format_general);
   return strdup (s);
   }
 
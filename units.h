@@ -7,12 +7,22 @@
 
 #pragma once
 
+#include <stdio.h>
+#include <stddef.h>
+
 // Maximum number of individual units in a compound unit
 #define MAX_UNIT_ELEMENTS 10
 
 // Maximum length of a unit token. In practice, > 4 is rare
 #define MAX_UNIT_STRING 64
 
+// Space needed for a formatted number, or a formatted set of units
+#define MAX_NUMBER_STRING 32
+#define MAX_FORMATTED_UNITS 256
+
+// Space for an error message from units_parse_into
+#define MAX_ERROR_STRING 256
+
 #ifndef BOOL
 typedef int BOOL;
 #endif
@@ -54,16 +64,53 @@ typedef struct _Units
   UnitAndPower units[MAX_UNIT_ELEMENTS];
   } Units;
 
+// units_format_general is the same as printf's %G; units_format_roundtrip
+//  gives the fewest digits that read back as exactly the same value
+typedef enum { units_format_general = 0, units_format_roundtrip } 
+  UnitsNumberFormat;
+
+// The result of checking and reducing a pair of units, so that any number
+//  of values can be converted between them without parsing or reducing
+//  again. Every conversion is n * factor + offset, or for inverse units 
+//  such as km/h and h/km, the reciprocal of n * factor. The offset is 
+//  non-zero only between scales of temperature, whose zeros differ; 
+//  otherwise it is -0.0, so that adding it leaves every value, even -0.0, 
+//  as it was
+typedef struct _UnitsPlan
+  {
+  BOOL inverse;
+  double factor;
+  double offset;
+  } UnitsPlan;
+
 
+void units_init (void);
 Units *units_parse (const char *text, char **error);
+BOOL units_parse_into (Units *self, const char *text, char *error, 
+  size_t error_size);
+BOOL units_parse_corrected (Units *self, const char *text, 
+  char *correction, size_t correction_size, char *error, size_t error_size);
 void units_free (Units *self);
 void units_dump (const Units *self);
 char *units_formt_string (const Units *self);
 double units_convert (double n, const Units *from_units, 
 const Units *to_units, char **error);
+BOOL units_plan_init (UnitsPlan *self, const Units *from_units, 
+  const Units *to_units, char **error);
+UnitsPlan *units_plan_create (const Units *from_units, const Units *to_units,
+  char **error);
+void units_plan_free (UnitsPlan *self);
+double units_plan_apply (const UnitsPlan *self, double n);
+void units_convert_array (const double *in, double *out, size_t n, 
+  const UnitsPlan *plan);
 char *units_format_string_and_value (const Units *self, double n, 
   BOOL force_decimal);
 char *units_format_string (const Units *self, BOOL plural);
+int units_format_number (char *s, size_t size, double n, 
+  UnitsNumberFormat format);
+int units_format_value (char *s, size_t size, const Units *self, double n,
+  BOOL force_decimal, UnitsNumberFormat format);
+double units_humanize (Units *self, double n, BOOL iec);
 void units_dump_tables (FILE *f); 
 
 